@@ -1,13 +1,83 @@
+#define _FILE_OFFSET_BITS 64 /* multi-GB inputs on 32 bit systems */
+#define _GNU_SOURCE          /* O_DIRECT, fopencookie() */
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "zlib/zlib.h"
 
-#define CHUNK_SIZE 4096 /* size of each block to be compressed */
+/* io_uring backend, talks to the kernel through the raw syscalls so there
+ * is no liburing dependency.  Build with -DNO_IO_URING to leave it out */
+#if defined(__linux__) && !defined(NO_IO_URING)
+#  include <errno.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+#  include <linux/io_uring.h>
+#  define HAVE_IO_URING
+#endif
+
+/* --direct bypasses the page cache with O_DIRECT, which needs buffers,
+ * sizes and file offsets aligned to the device's logical block size */
+#ifdef __linux__
+#  include <errno.h>
+#  include <fcntl.h>
+#  ifdef O_DIRECT
+#    define HAVE_DIRECT_IO
+#  endif
+#endif
+#define DIRECT_ALIGN 4096 /* covers 512 byte and 4K sector devices */
+
+/* --numa pins workers with pthread_setaffinity_np() and reads the node
+ * layout from sysfs */
+#ifdef __linux__
+#  include <sched.h>
+#  include <dirent.h>
+#  define HAVE_NUMA
+#endif
+
+/* Per-thread state and the blocks themselves, written on every block, are
+ * padded to a cache line so workers on different cores (or sockets) don't
+ * share lines */
+#define CACHE_LINE 64
+#ifdef __GNUC__
+#  define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+#else
+#  define CACHE_ALIGNED
+#endif
+
+#define DEFAULT_BLOCK_SIZE (128 * 1024) /* size of each block to be compressed */
+#define MIN_BLOCK_SIZE (64 * 1024)
+#define MAX_BLOCK_SIZE (16 * 1024 * 1024)
 #define CHUNK 16384     /* arbitrary size of decompression read */
+#define DICT_SIZE 32768 /* deflate window, history carried between primed blocks */
+
+/* Block index appended to .zl files with independent blocks, the magic can
+ * never start a zlib stream (CM would be 4) so readers stop cleanly on it */
+#define INDEX_MAGIC "TFCI"
+#define INDEX_VERSION 2       /* 1 had no level */
+#define INDEX_HEADER_SIZE 8   /* magic, version, entry size, 2 reserved */
+#define INDEX_ENTRY_SIZE 12   /* compressed size, uncompressed size, level, 3 reserved */
+#define INDEX_TRAILER_SIZE 12 /* # of entries, index length, magic */
+
+/* Checkpoint index (-i) of a gzip or zlib stream written by another tool,
+ * kept in a gzip compressed <file>.zri sidecar.  Access points as in
+ * zlib/examples/zran.c: at a deflate block boundary roughly every span bytes
+ * of output, the position in both streams and the 32K of output before it */
+#define ZRI_MAGIC "TFCZ"
+#define ZRI_VERSION 1
+#define ZRI_EXT ".zri"
+#define ZRI_HEADER_SIZE 24 /* magic, version, 3 reserved, span, size of the indexed file */
+#define ZRI_RECORD_SIZE 24 /* type, bits, 2 reserved, window size, in, out */
+#define DEFAULT_SPAN (1024 * 1024)
+#define MAX_SPAN_BUF (64 * 1024 * 1024) /* larger spans are inflated serially */
 
 /* ZLib 'hack' for OS compatibility */
 #if defined(MSDOS) || defined(OS2) || defined(WIN32) || defined(__CYGWIN__)
@@ -20,149 +90,2043 @@
 
 typedef unsigned char BYTE;
 
-/* Protos */
-int def(BYTE* buffer_in, unsigned int buff_in_sz, BYTE* buffer_out, unsigned int buff_out_sz, unsigned int* output_sz);
-void deflate_file(const char* input_fn, const char* output_fn, int n_workers);
-int inflate_file(FILE *source, FILE *dest);
-void* compression(void* thread);
+/* Progress and stats go here, stderr when the data itself goes to stdout */
+FILE* log_fp;
 
-/* Hold info about a worker thread */
+/* I/O backend of the reader and writer stages */
+#define IO_STDIO 0
+#define IO_URING 1 /* falls back to IO_STDIO when io_uring can't be used */
+
+/* How blocks are handed to the workers */
+#define SCHED_STEAL 0 /* per-worker run queues, idle workers steal */
+#define SCHED_QUEUE 1 /* one shared job queue */
+
+/* How a block was compressed, picked by the incompressible block check */
+#define PATH_DEFLATE 0 /* the configured level and strategy */
+#define PATH_HUFFMAN 1 /* Z_HUFFMAN_ONLY, skewed bytes but no point looking for matches */
+#define PATH_STORED  2 /* level 0, looks random */
+#define PROBE_BITS 12  /* log2 of the slots of the repeat probe of classify_block() */
+
+/* Output container */
+#define FORMAT_ZLIB 0 /* one zlib stream per block, or a single stream when priming */
+#define FORMAT_GZIP 1 /* a single gzip member */
+
+/* Command line options */
 typedef struct {
-	pthread_t thread;
-	char alive; /* 0 - idle, 1 - running, 2 - need to be reset */
+	int n_workers;
+	unsigned block_size; /* uncompressed bytes per block */
+	char prime; /* prime each block with the tail of the previous one, output one stream */
+	char format; /* FORMAT_ZLIB or FORMAT_GZIP */
+	int level;     /* 1 - 9 */
+	int strategy;  /* Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED */
+	int mem_level; /* 1 - 9, memory used for the hash table */
+	char mmap_input; /* map the input file instead of reading it */
+	char io;         /* IO_STDIO or IO_URING */
+	char direct;     /* O_DIRECT input and output */
+	char sched;      /* SCHED_STEAL or SCHED_QUEUE */
+	char numa;       /* pin workers and keep their buffers on their NUMA node */
+	double target_mbps; /* adapt the level of each block to this throughput, 0 to use level */
+	char detect;     /* store or Huffman code blocks that look incompressible */
+} options_t;
 
-	BYTE* input_buf;
+/* Hold info about a block of data moving through the pool.  Workers write
+ * the results of neighbouring blocks while the writer reads them, so each
+ * block gets its own cache lines */
+typedef struct {
+	BYTE* input_buf;    /* points into the mapped input when mapping */
 	BYTE* output_buf;
 	unsigned output_size; /* in bytes */
 	unsigned input_size;
 	int block_id; /* to maintain order */
-} worker_t;
+	int buf_index;      /* position in the block array, the registered buffer # for io_uring */
+	int home;           /* worker whose node holds the buffers with --numa */
+	int pending;        /* io_uring reads still in flight for this block */
+	off_t file_offset;  /* where an io_uring read or write of this block goes */
+	BYTE* dict_buf;     /* tail of the previous block when priming, also mapped, or a checkpoint's window */
+	unsigned dict_size;
+	int bits;           /* with a checkpoint index, bits of the first input byte that belong to the span */
+	uLong check;        /* adler32 or crc32 of the input in single stream mode, of the output with checkpoints */
+	int level;          /* level the block was compressed at */
+	int strategy;
+	char path;          /* PATH_DEFLATE, PATH_HUFFMAN or PATH_STORED */
+} CACHE_ALIGNED block_t;
+
+/* Sizes of one block as recorded in the index */
+typedef struct {
+	unsigned compressed_size;
+	unsigned uncompressed_size;
+	int level; /* -1 when the index predates levels */
+} index_entry_t;
+
+/* Block index of a .zl file, one entry per block in file order */
+typedef struct {
+	index_entry_t* entries;
+	int count;
+	int cap;
+} block_index_t;
+
+/* An access point of a checkpoint index */
+typedef struct {
+	off_t in;  /* first whole byte of the point in the compressed file */
+	off_t out; /* offset in the uncompressed data */
+	int bits;  /* the top 1-7 bits of the byte before in also belong to the point */
+	unsigned window_size; /* bytes of history, less than 32K only near the start */
+	BYTE window[DICT_SIZE];
+} checkpoint_t;
+
+/* An open .zri sidecar, read one point at a time */
+typedef struct {
+	gzFile fp;
+	off_t span;
+	off_t file_size; /* of the indexed file, to spot a stale sidecar */
+	off_t end_in;    /* end of the stream (trailer included) in both files, */
+	off_t end_out;   /* known once read_checkpoint() hits the end record */
+} checkpoints_t;
+
+/* Bounded FIFO of blocks shared between threads */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	block_t** items;
+	int cap;
+	int head;
+	int count;
+	char closed; /* set once no more blocks will be pushed */
+} queue_t;
+
+/* One worker's run queue for the work-stealing scheduler.  Blocks are
+ * added at the tail and both the owner and thieves take the oldest one
+ * from the head, since the writer needs blocks in order */
+typedef struct {
+	pthread_mutex_t lock;
+	block_t** items;
+	int cap;
+	int head;
+	int count;
+} CACHE_ALIGNED runq_t;
+
+/* Work-stealing scheduler, the reader deals blocks round-robin onto the
+ * workers' run queues and a worker whose queue runs dry steals from the
+ * others instead of idling behind a slow block */
+typedef struct {
+	runq_t* queues;
+	int n;
+	int next;            /* run queue the next block is dealt onto */
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* signalled when a block is dealt or the scheduler closes */
+	int queued;          /* blocks on all run queues */
+	char closed;
+} sched_t;
+
+/* Bounded ring of compressed blocks keyed by block_id, parks blocks that
+ * finish out of order until the writer reaches them */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready; /* signalled when the next in-order block is parked */
+	block_t** slots;
+	int cap;
+	int next_id; /* id of the next block to be written */
+} reorder_t;
+
+/* Per-run counters */
+typedef struct {
+	unsigned long threads_created;
+	unsigned long blocks;
+	double thread_mgmt_ms; /* time spent creating and joining threads */
+	double setup_ms;       /* --numa first touch and io_uring registration, between the two */
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	double read_stall_ms;  /* reader waiting for a free block */
+	double write_stall_ms; /* writer waiting for the next block in order */
+	unsigned long levels[10]; /* blocks compressed at each level */
+	unsigned long paths[3];   /* blocks that took each PATH_ */
+} stats_t;
+
+/* --target-throughput controller.  Workers report how fast each block
+ * compressed and the level of the next block moves down when the pool
+ * would fall short of the target, and up when there is headroom */
+typedef struct {
+	pthread_mutex_t lock;
+	double target;    /* MB/s each worker must sustain, 0 when not adapting */
+	double rate[10];  /* smoothed MB/s of one worker at each level, 0 until measured */
+	int level;        /* level for the next block */
+	int max_level;    /* the -1..-9 level, never exceeded */
+	int settled;      /* blocks since the last move, to retry a step up */
+} adapt_t;
+
+/* io_uring instance, each one is only ever used by a single thread */
+struct uring;
+
+/* State shared by the reader, worker and writer stages of one run */
+typedef struct {
+	FILE* i_fp;
+	FILE* o_fp;
+	const options_t* opts;
+	unsigned in_size;    /* size of each block's input buffer */
+	BYTE* map;           /* whole input file when mapped, blocks point into it */
+	off_t map_size;
+	unsigned out_bound;  /* size of each block's output buffer */
+	char direct;         /* input is O_DIRECT, reads must stay aligned */
+	char single_stream;  /* blocks are raw deflate segments of one stream */
+	char decompress;     /* blocks are read and inflated following index */
+	block_index_t* index; /* filled by the writer when compressing, read by the reader when decompressing */
+	checkpoints_t* checkpoints; /* decompressing one span per block from a .zri sidecar instead */
+	checkpoint_t* point; /* start of the next span, read ahead by the reader, out < 0 after the last */
+	uLong check;         /* check value of the spans, combined by the writer */
+	volatile char error; /* set by a worker that failed on its block */
+	queue_t free_blocks; /* blocks the reader can fill */
+	queue_t jobs;        /* blocks waiting for a worker with SCHED_QUEUE */
+	sched_t sched;       /* blocks waiting for a worker with SCHED_STEAL */
+	adapt_t adapt;
+	reorder_t done;      /* compressed blocks waiting for the writer */
+	struct uring* in_ring;  /* reader's ring, NULL when reading with stdio */
+	struct uring* out_ring; /* writer's ring, NULL when writing with stdio */
+	char numa;           /* workers are pinned and blocks dealt to their home worker */
+	block_t* blocks;     /* every block of the run, for first touch by their home worker */
+	int n_blocks;
+	int n_workers;
+#ifdef HAVE_NUMA
+	pthread_barrier_t touched; /* workers and run_pipeline() wait here until the buffers are placed */
+#endif
+	stats_t stats;
+} pipeline_t;
+
+/* Hold info about a long-lived worker thread */
+typedef struct {
+	pthread_t thread;
+	int id;               /* index of the worker's run queue */
+	int cpu;              /* CPU the worker is pinned to with --numa */
+	int node;
+	pipeline_t* pipeline;
+	z_stream strm;        /* deflate/inflate state reused for every block */
+	int level;            /* level strm is set to */
+	unsigned long blocks; /* # of blocks compressed by this worker */
+	unsigned long allocs; /* # of allocations made by zlib for this worker */
+	unsigned long steals; /* # of those taken from another worker's run queue */
+	double stall_ms;      /* time spent idle waiting for work */
+} CACHE_ALIGNED worker_t;
+
+/* Protos */
+int def_init(z_stream* strm, worker_t* worker, const options_t* opts, int raw);
+int set_params(z_stream* strm, int level, int strategy);
+int def(z_stream* strm, int level, int strategy, BYTE* buffer_in, unsigned int buff_in_sz, BYTE* buffer_out, unsigned int buff_out_sz, unsigned int* output_sz);
+int def_raw(z_stream* strm, int level, int strategy, BYTE* buffer_in, unsigned int buff_in_sz, BYTE* dict, unsigned int dict_sz, BYTE* buffer_out, unsigned int buff_out_sz, unsigned int* output_sz);
+int deflate_file(const char* input_fn, const char* output_fn, const options_t* opts);
+int inflate_file(FILE *source, FILE *dest, off_t skip, off_t length);
+int extract_indexed(FILE* source, FILE* dest, const block_index_t* index, off_t offset, off_t length);
+int put_range(FILE* fp, const BYTE* buf, unsigned size, off_t* skip, off_t* length);
+int parse_range(const char* str, off_t* offset, off_t* length);
+int build_checkpoints(FILE* source, gzFile dest, unsigned span, off_t file_size, int* count);
+int open_checkpoints(checkpoints_t* cp, const char* fn, off_t file_size);
+int read_checkpoint(checkpoints_t* cp, checkpoint_t* point);
+int extract_checkpoints(FILE* source, FILE* dest, checkpoints_t* cp, off_t offset, off_t length);
+int scan_checkpoints(checkpoints_t* cp, unsigned* max_in, unsigned* max_out, int* count);
+int inflate_checkpoints(FILE* source, FILE* dest, checkpoints_t* cp, const options_t* opts);
+unsigned next_span(pipeline_t* pl, block_t* block, off_t* offset);
+int inf_span(z_stream* strm, BYTE* buffer_in, unsigned int buff_in_sz, int bits, BYTE* dict, unsigned int dict_sz, BYTE* buffer_out, unsigned int buff_out_sz);
+int inflate_indexed(FILE* source, FILE* dest, block_index_t* index, const options_t* opts);
+int inf_block(z_stream* strm, BYTE* buffer_in, unsigned int buff_in_sz, BYTE* buffer_out, unsigned int buff_out_sz, unsigned int* output_sz);
+void run_pipeline(pipeline_t* pl, void* (*work)(void*), int n_workers);
+void* compression(void* thread);
+void* decompression(void* thread);
+void* reader(void* arg);
+void* writer(void* arg);
+void queue_init(queue_t* q, int cap);
+void queue_destroy(queue_t* q);
+void queue_push(queue_t* q, block_t* b, double* stall_ms);
+block_t* queue_pop(queue_t* q, double* stall_ms);
+block_t* queue_try_pop(queue_t* q);
+void queue_close(queue_t* q);
+void reorder_init(reorder_t* r, int cap);
+void reorder_destroy(reorder_t* r);
+void reorder_put(reorder_t* r, block_t* b);
+block_t* reorder_take(reorder_t* r, double* stall_ms);
+void sched_init(sched_t* s, int n, int cap);
+void sched_destroy(sched_t* s);
+void sched_push(sched_t* s, block_t* b, int home);
+block_t* runq_pop(runq_t* q);
+block_t* sched_pop(sched_t* s, int self, unsigned long* steals, double* stall_ms);
+void sched_close(sched_t* s);
+void submit_job(pipeline_t* pl, block_t* b);
+block_t* next_job(worker_t* worker);
+void worker_start(worker_t* worker);
+int numa_plan(worker_t* workers, int n_workers);
+void close_jobs(pipeline_t* pl);
+block_t* reorder_try_take(reorder_t* r);
+double elapsed_ms(const struct timeval* start);
+unsigned block_bound(const options_t* opts);
+int write_header(FILE* fp, const options_t* opts);
+void put_be32(BYTE* buf, uLong val);
+void put_le32(BYTE* buf, uLong val);
+uLong get_le32(const BYTE* buf);
+void put_le64(BYTE* buf, off_t val);
+off_t get_le64(const BYTE* buf);
+void index_add(block_index_t* index, unsigned compressed_size, unsigned uncompressed_size, int level);
+void adapt_init(adapt_t* a, const options_t* opts, int n_workers);
+int adapt_level(adapt_t* a);
+void adapt_report(adapt_t* a, int level, unsigned bytes, double ms);
+void print_levels(const unsigned long* levels);
+int classify_block(const BYTE* buf, unsigned size);
+unsigned probe_repeats(const BYTE* buf, unsigned runs, unsigned step);
+int write_index(FILE* fp, const block_index_t* index);
+int read_index(FILE* fp, block_index_t* index);
+int parse_size(const char* str, unsigned* size);
+int parse_strategy(const char* str, int* strategy);
+void usage(void);
+FILE* open_file(const char* fn, const char* mode);
+FILE* open_direct(const char* fn, const char* mode, unsigned chunk);
+void close_file(FILE* fp);
+void* alloc_buf(size_t size, char aligned);
+unsigned read_direct(int fd, BYTE* buf, unsigned len);
+void advise_readahead(BYTE* addr, size_t len);
+voidpf count_alloc(voidpf opaque, uInt items, uInt size);
+void count_free(voidpf opaque, voidpf ptr);
+
+/* zlib allocator hooks that count the allocations made for a worker */
+voidpf count_alloc(voidpf opaque, uInt items, uInt size) {
+	((worker_t*) opaque)->allocs++;
+	return malloc((size_t) items * size);
+}
+
+void count_free(voidpf opaque, voidpf ptr) {
+	(void) opaque;
+	free(ptr);
+}
+
+/* Allocate the long-lived deflate state of a worker, every block after that
+ * only pays for a deflateReset().  Returns the deflateInit2() code.
+ * Params:
+ * strm   - Stream to initialize
+ * worker - Owner of the stream, its allocations are counted
+ * opts   - Level, strategy and memory level to use
+ * raw    - Nonzero for raw deflate segments (no zlib header/trailer) */
+int def_init(z_stream* strm, worker_t* worker, const options_t* opts, int raw) {
+	strm->zalloc = count_alloc;
+	strm->zfree  = count_free;
+	strm->opaque = worker;
+	return deflateInit2(strm, opts->level, Z_DEFLATED, raw ? -15 : 15, opts->mem_level, opts->strategy);
+}
+
+/* Recycle a stream (keeping the window/hash/pending buffers) and switch it
+ * to level and strategy.  When that changes deflate's compress function,
+ * deflateParams() flushes with Z_BLOCK, which on an empty stream writes the
+ * zlib header with the level hint of whatever the stream compressed before.
+ * That goes to a scratch buffer and a second reset drops it, so the header
+ * of every block carries its own level whichever worker ran it.
+ * Returns Z_OK or what deflateReset()/deflateParams() returns */
+int set_params(z_stream* strm, int level, int strategy) {
+	BYTE scratch[16];
+	int ret;
+
+	ret = deflateReset(strm);
+	if (ret != Z_OK)
+		return ret;
 
+	strm->avail_in  = 0;
+	strm->avail_out = sizeof(scratch);
+	strm->next_out  = scratch;
+	ret = deflateParams(strm, level, strategy);
+	if (ret != Z_OK)
+		return ret;
+	return deflateReset(strm);
+}
 
-/* Compress bytes from buffer source to buffer dest.
- *    def() returns Z_OK on success, Z_MEM_ERROR if memory could not be
- *       allocated for processing, Z_STREAM_ERROR if an invalid compression
- *          level is supplied, Z_VERSION_ERROR if the version of zlib.h and the
- *             version of the library linked do not match. 
+/* Compress bytes from buffer source to buffer dest as a complete zlib stream.
+ *    def() returns Z_OK on success, Z_STREAM_ERROR if the stream
+ *       state is inconsistent or Z_BUF_ERROR if the output didn't fit.
  * Params:
+ * strm       - A stream set up by def_init(), reset before use
+ * level      - zlib level and strategy for this block, see set_params()
+ * strategy
  * buffer_in  - A buffer of uncompressed bytes
  * buff_in_sz - # of bytes to compress
  * buffer_out - A buffer to write compressed data to
  * output_sz  - Place to store # of compressed bytes */
-int def(BYTE* buffer_in, unsigned int buff_in_sz, BYTE* buffer_out, unsigned int buff_out_sz, unsigned int* output_sz) {
+int def(z_stream* strm, int level, int strategy, BYTE* buffer_in, unsigned int buff_in_sz, BYTE* buffer_out, unsigned int buff_out_sz, unsigned int* output_sz) {
 	int ret;
 	unsigned have;
-	z_stream strm;
-	
-	/* allocate deflate state */
-	strm.zalloc = Z_NULL;
-	strm.zfree  = Z_NULL;
-	strm.opaque = Z_NULL;
-	ret = deflateInit(&strm, Z_BEST_COMPRESSION); /* Z_DEFAULT_COMPRESSION */
+
+	ret = set_params(strm, level, strategy);
 	if (ret != Z_OK)
 		return ret;
-	
-	strm.avail_in = buff_in_sz; /* # of avail bytes */
-	strm.next_in  = buffer_in;  /* ptr to first byte of data */
-	
-	strm.avail_out = buff_out_sz; /* size of output buff */
-	strm.next_out  = buffer_out;  /* ptr to first byte of o buff */
-	    
-	ret = deflate(&strm, Z_FINISH); /* no bad return value */
+
+	strm->avail_out = buff_out_sz; /* size of output buff */
+	strm->next_out  = buffer_out;  /* ptr to first byte of o buff */
+
+	strm->avail_in = buff_in_sz; /* # of avail bytes */
+	strm->next_in  = buffer_in;  /* ptr to first byte of data */
+
+	ret = deflate(strm, Z_FINISH);
 	assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-	    
-	have = buff_out_sz - strm.avail_out;	
+	if (ret != Z_STREAM_END)        /* out of room, the stream is cut short */
+		return Z_BUF_ERROR;
 
-	assert(strm.avail_in == 0); /* all input must be used */
+	have = buff_out_sz - strm->avail_out;
+
+	assert(strm->avail_in == 0); /* all input must be used */
 	(*output_sz) = have;
+	return Z_OK;
+}
 
-	/* clean up and return */
-	(void)deflateEnd(&strm);
+/* Compress bytes from buffer source to a raw deflate segment that can be
+ * concatenated with the segments of the blocks around it.  The stream is
+ * primed with dict (the data just before this block) so matches can reach
+ * back across the block boundary, and it ends with Z_SYNC_FLUSH so the
+ * segment stops on a byte boundary without marking the last deflate block.
+ * Returns the same codes as def().
+ * Params:
+ * strm       - A raw stream set up by def_init(), reset before use
+ * level      - zlib level and strategy for this block, see set_params()
+ * strategy
+ * buffer_in  - A buffer of uncompressed bytes
+ * buff_in_sz - # of bytes to compress
+ * dict       - Up to 32K of preceding data, or NULL for the first block
+ * dict_sz    - # of bytes in dict
+ * buffer_out - A buffer to write compressed data to
+ * output_sz  - Place to store # of compressed bytes */
+int def_raw(z_stream* strm, int level, int strategy, BYTE* buffer_in, unsigned int buff_in_sz, BYTE* dict, unsigned int dict_sz, BYTE* buffer_out, unsigned int buff_out_sz, unsigned int* output_sz) {
+	int ret;
+
+	ret = set_params(strm, level, strategy);
+	if (ret != Z_OK)
+		return ret;
+
+	strm->avail_out = buff_out_sz;
+	strm->next_out  = buffer_out;
+
+	if(dict_sz) {
+		ret = deflateSetDictionary(strm, dict, dict_sz);
+		assert(ret == Z_OK);
+	}
+
+	strm->avail_in  = buff_in_sz;
+	strm->next_in   = buffer_in;
+
+	ret = deflate(strm, Z_SYNC_FLUSH);
+	assert(ret != Z_STREAM_ERROR);
+	if (strm->avail_in != 0 || strm->avail_out == 0) /* input left or flush incomplete */
+		return Z_BUF_ERROR;
+	(*output_sz) = buff_out_sz - strm->avail_out;
 	return Z_OK;
 }
 
+/* Decompress one block of a .zl file, which is a complete zlib stream.
+ * Returns Z_OK, or Z_DATA_ERROR if the block is corrupt or doesn't
+ * inflate to exactly buff_out_sz bytes.
+ * Params:
+ * strm       - An inflate stream, reset before use
+ * buffer_in  - The compressed block
+ * buff_in_sz - # of compressed bytes
+ * buffer_out - A buffer to write the uncompressed data to
+ * buff_out_sz - Expected # of uncompressed bytes, from the index
+ * output_sz  - Place to store # of uncompressed bytes */
+int inf_block(z_stream* strm, BYTE* buffer_in, unsigned int buff_in_sz, BYTE* buffer_out, unsigned int buff_out_sz, unsigned int* output_sz) {
+	int ret;
+
+	ret = inflateReset(strm);
+	if (ret != Z_OK)
+		return ret;
+
+	strm->avail_in  = buff_in_sz;
+	strm->next_in   = buffer_in;
+	strm->avail_out = buff_out_sz;
+	strm->next_out  = buffer_out;
+
+	ret = inflate(strm, Z_FINISH);
+	(*output_sz) = buff_out_sz - strm->avail_out;
+	if(ret != Z_STREAM_END || strm->avail_in != 0)
+		return Z_DATA_ERROR;
+	return Z_OK;
+}
+
+/* Inflate one span of a checkpoint index, raw deflate that starts bits
+ * into the first input byte with dict as the history before it.  Returns
+ * Z_OK when exactly buff_out_sz bytes came out, Z_DATA_ERROR otherwise.
+ * Params:
+ * strm       - A raw inflate stream, reset before use
+ * buffer_in  - The span's compressed bytes, from the byte holding its first bit
+ * buff_in_sz - # of compressed bytes
+ * bits       - # of high bits of buffer_in[0] that belong to the span, 0 to start on a byte
+ * dict       - The 32K (or less at the start of the file) of output before the span
+ * dict_sz    - # of bytes in dict, 0 at the start of the file
+ * buffer_out - A buffer to write the uncompressed span to
+ * buff_out_sz - Exact # of uncompressed bytes in the span, as the reader set it from the sidecar */
+int inf_span(z_stream* strm, BYTE* buffer_in, unsigned int buff_in_sz, int bits, BYTE* dict, unsigned int dict_sz, BYTE* buffer_out, unsigned int buff_out_sz) {
+	int ret;
+
+	ret = inflateReset(strm);
+	if (ret != Z_OK)
+		return ret;
+	if (bits) {
+		(void)inflatePrime(strm, bits, buffer_in[0] >> (8 - bits));
+		buffer_in++;
+		buff_in_sz--;
+	}
+	if (dict_sz)
+		(void)inflateSetDictionary(strm, dict, dict_sz);
+
+	strm->avail_in = buff_in_sz;
+	strm->next_in  = buffer_in;
+	strm->avail_out = buff_out_sz;
+	strm->next_out  = buffer_out;
+	ret = inflate(strm, Z_NO_FLUSH);
+	if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+		return Z_DATA_ERROR;
+	return strm->avail_out == 0 ? Z_OK : Z_DATA_ERROR;
+}
+
+/* Store val as 4 little endian bytes */
+void put_le32(BYTE* buf, uLong val) {
+	buf[0] = val & 0xff;
+	buf[1] = (val >> 8) & 0xff;
+	buf[2] = (val >> 16) & 0xff;
+	buf[3] = (val >> 24) & 0xff;
+}
+
+/* Store val as 4 big endian bytes */
+void put_be32(BYTE* buf, uLong val) {
+	buf[0] = (val >> 24) & 0xff;
+	buf[1] = (val >> 16) & 0xff;
+	buf[2] = (val >> 8) & 0xff;
+	buf[3] = val & 0xff;
+}
+
+/* Load 4 little endian bytes */
+uLong get_le32(const BYTE* buf) {
+	return (uLong) buf[0] | ((uLong) buf[1] << 8) | ((uLong) buf[2] << 16) | ((uLong) buf[3] << 24);
+}
+
+/* Store val as 8 little endian bytes */
+void put_le64(BYTE* buf, off_t val) {
+	put_le32(buf, (uLong) val & 0xffffffff);
+	put_le32(buf + 4, (uLong) (val >> 32) & 0xffffffff);
+}
+
+/* Load 8 little endian bytes */
+off_t get_le64(const BYTE* buf) {
+	return (off_t) get_le32(buf) | ((off_t) get_le32(buf + 4) << 32);
+}
+
+/* Append the sizes of the next block to the index */
+void index_add(block_index_t* index, unsigned compressed_size, unsigned uncompressed_size, int level) {
+	if(index->count == index->cap) {
+		index->cap = index->cap ? index->cap * 2 : 1024;
+		index->entries = realloc(index->entries, index->cap * sizeof(index_entry_t));
+	}
+	index->entries[index->count].compressed_size = compressed_size;
+	index->entries[index->count].uncompressed_size = uncompressed_size;
+	index->entries[index->count].level = level;
+	index->count++;
+}
+
+/* Write the index after the last block:
+ *   "TFCI", version, entry size, 0, 0
+ *   per block: compressed size, uncompressed size (32 bit little endian),
+ *              level the block was compressed at, 0, 0, 0
+ *   # of entries, total index length, "TFCI"
+ * The trailer lets a reader find the index from the end of the file.
+ * Returns 0 on success */
+int write_index(FILE* fp, const block_index_t* index) {
+	BYTE buf[INDEX_TRAILER_SIZE];
+	int i;
+
+	memcpy(buf, INDEX_MAGIC, 4);
+	buf[4] = INDEX_VERSION;
+	buf[5] = INDEX_ENTRY_SIZE;
+	buf[6] = buf[7] = 0;
+	fwrite(buf, 1, INDEX_HEADER_SIZE, fp);
+
+	for(i = 0; i < index->count; i++) {
+		put_le32(buf, index->entries[i].compressed_size);
+		put_le32(buf + 4, index->entries[i].uncompressed_size);
+		buf[8] = index->entries[i].level;
+		buf[9] = buf[10] = buf[11] = 0;
+		fwrite(buf, 1, INDEX_ENTRY_SIZE, fp);
+	}
+
+	put_le32(buf, index->count);
+	put_le32(buf + 4, INDEX_HEADER_SIZE + (uLong) index->count * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE);
+	memcpy(buf + 8, INDEX_MAGIC, 4);
+	fwrite(buf, 1, INDEX_TRAILER_SIZE, fp);
+	return ferror(fp) ? -1 : 0;
+}
+
+/* Look for a block index at the end of fp and load it.  Returns 0 if a
+ * consistent index was found, -1 if there is none (not a .zl file with
+ * independent blocks, or fp can't seek).  fp is rewound either way */
+int read_index(FILE* fp, block_index_t* index) {
+	BYTE buf[INDEX_TRAILER_SIZE];
+	BYTE entry[INDEX_ENTRY_SIZE];
+	off_t file_size, data_size = 0;
+	uLong count, length, i;
+	int entry_size, known, version, ret = -1;
+
+	index->entries = NULL;
+	index->count = index->cap = 0;
+
+	if(fseeko(fp, 0, SEEK_END) || (file_size = ftello(fp)) < INDEX_HEADER_SIZE + INDEX_TRAILER_SIZE)
+		goto done;
+	if(fseeko(fp, file_size - INDEX_TRAILER_SIZE, SEEK_SET) || fread(buf, 1, INDEX_TRAILER_SIZE, fp) != INDEX_TRAILER_SIZE)
+		goto done;
+	if(memcmp(buf + 8, INDEX_MAGIC, 4))
+		goto done;
+	count = get_le32(buf);
+	length = get_le32(buf + 4);
+	if(length > (uLong) file_size || fseeko(fp, file_size - length, SEEK_SET) || fread(buf, 1, INDEX_HEADER_SIZE, fp) != INDEX_HEADER_SIZE)
+		goto done;
+	entry_size = buf[5];
+	version = buf[4];
+	known = version < 2 ? 8 : INDEX_ENTRY_SIZE; /* fields this reader knows */
+	if(memcmp(buf, INDEX_MAGIC, 4) || version < 1 || version > INDEX_VERSION || entry_size < known ||
+	   length != INDEX_HEADER_SIZE + count * entry_size + INDEX_TRAILER_SIZE)
+		goto done;
+
+	/* entries may be longer than this reader knows, skip the rest */
+	for(i = 0; i < count; i++) {
+		if(fread(entry, 1, known, fp) != (size_t) known ||
+		   (entry_size > known && fseeko(fp, entry_size - known, SEEK_CUR)))
+			goto done;
+		index_add(index, get_le32(entry), get_le32(entry + 4), version < 2 ? -1 : entry[8]);
+		if(!index->entries[i].compressed_size || !index->entries[i].uncompressed_size ||
+		   index->entries[i].uncompressed_size > MAX_BLOCK_SIZE || index->entries[i].compressed_size > compressBound(MAX_BLOCK_SIZE))
+			goto done;
+		data_size += index->entries[i].compressed_size;
+	}
+
+	/* the blocks must exactly fill the file up to the index */
+	if(data_size + length == (uLong) file_size)
+		ret = 0;
+
+done:
+	if(ret) {
+		free(index->entries);
+		index->entries = NULL;
+		index->count = index->cap = 0;
+	}
+	rewind(fp);
+	return ret;
+}
+
+/* Worst case size of a compressed block, taken from deflateBound() so the
+ * output buffer can never overflow even on incompressible data */
+unsigned block_bound(const options_t* opts) {
+	z_stream strm;
+	unsigned bound;
+
+	strm.zalloc = Z_NULL;
+	strm.zfree  = Z_NULL;
+	strm.opaque = Z_NULL;
+	if(deflateInit2(&strm, opts->level, Z_DEFLATED, 15, opts->mem_level, opts->strategy) != Z_OK)
+		return compressBound(opts->block_size) + 16;
+	bound = deflateBound(&strm, opts->block_size);
+	(void)deflateEnd(&strm);
+
+	/* this deflateBound() doesn't know about Z_FIXED, whose codes spend 9
+	 * bits on literals 144..255: allow 9/8 of the input, a header and end
+	 * code for every deflate block (one per lit_bufsize symbols) and the
+	 * zlib wrapper */
+	if(opts->strategy == Z_FIXED) {
+		unsigned fixed = opts->block_size + (opts->block_size >> 3) + 1 +
+		                 ((opts->block_size >> (opts->mem_level + 6)) + 1) * 2 + 6;
+		if(fixed > bound)
+			bound = fixed;
+	}
+
+	/* deflateBound() assumes Z_FINISH, leave room for a sync flush marker */
+	return bound + 16;
+}
+
+/* Write the zlib or gzip header of a single stream, the level hints match
+ * what deflate() itself would write.  Returns the # of bytes written */
+int write_header(FILE* fp, const options_t* opts) {
+	BYTE header[10];
+	int flevel;
+
+	if(opts->format == FORMAT_GZIP) {
+		/* magic, deflate, no flags, no mtime, level hint, unix */
+		header[0] = 0x1f;
+		header[1] = 0x8b;
+		header[2] = 8;
+		memset(header + 3, 0, 5);
+		header[8] = opts->level == 9 ? 2 : (opts->level == 1 ? 4 : 0);
+		header[9] = 3;
+		return fwrite(header, 1, 10, fp);
+	}
+
+	/* deflate with a 32K window, FCHECK makes the header a multiple of 31 */
+	if(opts->strategy >= Z_HUFFMAN_ONLY || opts->level < 2)
+		flevel = 0;
+	else if(opts->level < 6)
+		flevel = 1;
+	else if(opts->level == 6)
+		flevel = 2;
+	else
+		flevel = 3;
+	header[0] = 0x78;
+	header[1] = flevel << 6;
+	header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+	return fwrite(header, 1, 2, fp);
+}
+
+/* Ask the kernel to start reading a range of the mapped input, madvise()
+ * wants a page aligned start */
+void advise_readahead(BYTE* addr, size_t len) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t skew = (size_t) addr % page;
+
+	(void)madvise(addr - skew, len + skew, MADV_WILLNEED);
+}
+
+/* Milliseconds since start */
+double elapsed_ms(const struct timeval* start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+void queue_init(queue_t* q, int cap) {
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	q->items = malloc(cap * sizeof(block_t*));
+	q->cap = cap;
+	q->head = 0;
+	q->count = 0;
+	q->closed = 0;
+}
+
+void queue_destroy(queue_t* q) {
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+	free(q->items);
+}
+
+/* Add a block to the tail, waiting for room if the queue is full.
+ * Time spent waiting is added to stall_ms when it isn't NULL */
+void queue_push(queue_t* q, block_t* b, double* stall_ms) {
+	struct timeval start;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->count == q->cap) {
+		gettimeofday(&start, NULL);
+		while(q->count == q->cap)
+			pthread_cond_wait(&q->not_full, &q->lock);
+		if(stall_ms) (*stall_ms) += elapsed_ms(&start);
+	}
+	q->items[(q->head + q->count) % q->cap] = b;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Take a block from the head, returns NULL once the queue is closed and drained */
+block_t* queue_pop(queue_t* q, double* stall_ms) {
+	block_t* b = NULL;
+	struct timeval start;
+
+	pthread_mutex_lock(&q->lock);
+	if(!q->count && !q->closed) {
+		gettimeofday(&start, NULL);
+		while(!q->count && !q->closed)
+			pthread_cond_wait(&q->not_empty, &q->lock);
+		if(stall_ms) (*stall_ms) += elapsed_ms(&start);
+	}
+	if(q->count) {
+		b = q->items[q->head];
+		q->head = (q->head + 1) % q->cap;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return b;
+}
+
+/* Take a block from the head without waiting, NULL if the queue is empty */
+block_t* queue_try_pop(queue_t* q) {
+	block_t* b = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->count) {
+		b = q->items[q->head];
+		q->head = (q->head + 1) % q->cap;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return b;
+}
+
+/* Wake everyone waiting on the queue, no more blocks will be pushed */
+void queue_close(queue_t* q) {
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void reorder_init(reorder_t* r, int cap) {
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->ready, NULL);
+	r->slots = calloc(cap, sizeof(block_t*));
+	r->cap = cap;
+	r->next_id = 0;
+}
+
+void reorder_destroy(reorder_t* r) {
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->ready);
+	free(r->slots);
+}
+
+/* Park a compressed block in its slot, the caller guarantees that
+ * block_id - next_id < cap so a slot is never reused before it is taken */
+void reorder_put(reorder_t* r, block_t* b) {
+	pthread_mutex_lock(&r->lock);
+	r->slots[b->block_id % r->cap] = b;
+	if(b->block_id == r->next_id)
+		pthread_cond_signal(&r->ready);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Wait for the next in-order block and remove it from the ring */
+block_t* reorder_take(reorder_t* r, double* stall_ms) {
+	block_t* b;
+	int slot;
+	struct timeval start;
+
+	pthread_mutex_lock(&r->lock);
+	slot = r->next_id % r->cap;
+	if(!r->slots[slot]) {
+		gettimeofday(&start, NULL);
+		while(!r->slots[slot])
+			pthread_cond_wait(&r->ready, &r->lock);
+		if(stall_ms) (*stall_ms) += elapsed_ms(&start);
+	}
+	b = r->slots[slot];
+	r->slots[slot] = NULL;
+	r->next_id++;
+	pthread_mutex_unlock(&r->lock);
+	return b;
+}
+
+/* Take the next block in order without waiting, NULL if it isn't done yet */
+block_t* reorder_try_take(reorder_t* r) {
+	block_t* b;
+	int slot;
+
+	pthread_mutex_lock(&r->lock);
+	slot = r->next_id % r->cap;
+	b = r->slots[slot];
+	if(b) {
+		r->slots[slot] = NULL;
+		r->next_id++;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return b;
+}
+
+void sched_init(sched_t* s, int n, int cap) {
+	int i;
+
+	/* one cache line (or more) per run queue, thieves lock them from other cores */
+	if(posix_memalign((void**) &s->queues, CACHE_LINE, n * sizeof(runq_t)))
+		exit(1);
+	memset(s->queues, 0, n * sizeof(runq_t));
+	for(i = 0; i < n; i++) {
+		pthread_mutex_init(&s->queues[i].lock, NULL);
+		s->queues[i].items = malloc(cap * sizeof(block_t*));
+		s->queues[i].cap = cap;
+	}
+	s->n = n;
+	s->next = 0;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->work, NULL);
+	s->queued = 0;
+	s->closed = 0;
+}
+
+void sched_destroy(sched_t* s) {
+	int i;
+
+	for(i = 0; i < s->n; i++) {
+		pthread_mutex_destroy(&s->queues[i].lock);
+		free(s->queues[i].items);
+	}
+	free(s->queues);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->work);
+}
+
+/* Deal a block onto the next run queue, or onto home's when it isn't -1.
+ * Only the reader calls this.  A run queue can hold every block of the
+ * pipeline so it never fills up */
+void sched_push(sched_t* s, block_t* b, int home) {
+	runq_t* q;
+
+	if(home < 0) {
+		home = s->next;
+		s->next = (s->next + 1) % s->n;
+	}
+	q = &s->queues[home];
+	pthread_mutex_lock(&q->lock);
+	q->items[(q->head + q->count) % q->cap] = b;
+	q->count++;
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_mutex_lock(&s->lock);
+	s->queued++;
+	pthread_cond_signal(&s->work);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Take the oldest block of a run queue, NULL if it is empty */
+block_t* runq_pop(runq_t* q) {
+	block_t* b = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->count) {
+		b = q->items[q->head];
+		q->head = (q->head + 1) % q->cap;
+		q->count--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return b;
+}
+
+/* Take a block from worker self's run queue, or steal one from the next
+ * busy worker over, sleeping while every queue is empty.  Returns NULL
+ * once the scheduler is closed and drained */
+block_t* sched_pop(sched_t* s, int self, unsigned long* steals, double* stall_ms) {
+	block_t* b;
+	struct timeval start;
+	int i;
+
+	for(;;) {
+		for(i = 0; i < s->n; i++) {
+			if((b = runq_pop(&s->queues[(self + i) % s->n]))) {
+				if(i) (*steals)++;
+				pthread_mutex_lock(&s->lock);
+				s->queued--;
+				pthread_mutex_unlock(&s->lock);
+				return b;
+			}
+		}
+
+		/* queued can briefly count a block another worker just took, then we scan again */
+		pthread_mutex_lock(&s->lock);
+		if(!s->queued && s->closed) {
+			pthread_mutex_unlock(&s->lock);
+			return NULL;
+		}
+		if(!s->queued) {
+			gettimeofday(&start, NULL);
+			while(!s->queued && !s->closed)
+				pthread_cond_wait(&s->work, &s->lock);
+			if(stall_ms) (*stall_ms) += elapsed_ms(&start);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/* Wake every idle worker, no more blocks will be dealt */
+void sched_close(sched_t* s) {
+	pthread_mutex_lock(&s->lock);
+	s->closed = 1;
+	pthread_cond_broadcast(&s->work);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Hand a filled block to the workers with the scheduler picked by --sched */
+void submit_job(pipeline_t* pl, block_t* b) {
+	if(pl->opts->sched == SCHED_STEAL)
+		sched_push(&pl->sched, b, pl->numa ? b->home : -1);
+	else
+		queue_push(&pl->jobs, b, NULL);
+}
+
+block_t* next_job(worker_t* worker) {
+	pipeline_t* pl = worker->pipeline;
+
+	if(pl->opts->sched == SCHED_STEAL)
+		return sched_pop(&pl->sched, worker->id, &worker->steals, &worker->stall_ms);
+	return queue_pop(&pl->jobs, &worker->stall_ms);
+}
+
+void close_jobs(pipeline_t* pl) {
+	if(pl->opts->sched == SCHED_STEAL)
+		sched_close(&pl->sched);
+	else
+		queue_close(&pl->jobs);
+}
+
+/* Called by each worker before it allocates its zlib state.  With --numa the
+ * worker pins itself to its CPU and is the first to touch the buffers of
+ * its home blocks, so the kernel places them (and the zlib state allocated
+ * next) on the worker's node */
+void worker_start(worker_t* worker) {
+	pipeline_t* pl = worker->pipeline;
+	block_t* b;
+	int i;
+
+	if(!pl->numa)
+		return;
+#ifdef HAVE_NUMA
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(worker->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	for(i = worker->id; i < pl->n_blocks; i += pl->n_workers) {
+		b = &pl->blocks[i];
+		if(!pl->map) {
+			memset(b->input_buf, 0, pl->in_size);
+			if(b->dict_buf)
+				memset(b->dict_buf, 0, DICT_SIZE);
+		}
+		memset(b->output_buf, 0, pl->out_bound);
+	}
+	pthread_barrier_wait(&pl->touched);
+#else
+	(void) b;
+	(void) i;
+#endif
+}
+
+void adapt_init(adapt_t* a, const options_t* opts, int n_workers) {
+	pthread_mutex_init(&a->lock, NULL);
+	memset(a->rate, 0, sizeof(a->rate));
+	a->target = opts->target_mbps / n_workers;
+	a->level = a->max_level = opts->level;
+	a->settled = 0;
+}
+
+int adapt_level(adapt_t* a) {
+	int level;
+
+	pthread_mutex_lock(&a->lock);
+	level = a->level;
+	pthread_mutex_unlock(&a->lock);
+	return level;
+}
+
+/* Fold a block that took ms at level into the rate of that level and pick
+ * the next level: one down when the current one is too slow, one up when
+ * the next one is known to be fast enough, or when it hasn't been measured
+ * (or not for a while) and the current one has 25% headroom.  So the pool
+ * settles on the best ratio that still meets the target */
+void adapt_report(adapt_t* a, int level, unsigned bytes, double ms) {
+	double rate = bytes / (ms > 0.001 ? ms : 0.001) / 1000.0; /* MB/s */
+
+	pthread_mutex_lock(&a->lock);
+	a->rate[level] = a->rate[level] ? a->rate[level] * 0.75 + rate * 0.25 : rate;
+	if(level == a->level) {
+		/* data changes, so forget the measurement of a level we backed off from */
+		if(++a->settled >= 64 && a->level < a->max_level)
+			a->rate[a->level + 1] = 0;
+		if(a->rate[level] < a->target && a->level > 1) {
+			a->level--;
+			a->settled = 0;
+		} else if(a->level < a->max_level &&
+		          (a->rate[a->level + 1] ? a->rate[a->level + 1] >= a->target : a->rate[level] >= a->target * 1.25)) {
+			a->level++;
+			a->settled = 0;
+		}
+	}
+	pthread_mutex_unlock(&a->lock);
+}
+
+/* Guess from a byte histogram whether a block is worth deflating.  Looks
+ * at up to 64 evenly spaced 256 byte runs, and uses the collision
+ * probability sum(p^2) as the measure, which is 2^-entropy for Renyi
+ * entropy and needs no log():
+ *   >= 7.9 bits/byte (media, already compressed data) -> PATH_STORED
+ *   >= 7.5 bits/byte, Huffman coding alone gets what there is -> PATH_HUFFMAN
+ * A flat histogram alone doesn't mean there are no matches (tables,
+ * counters, a repeated 0..255 pattern), so either verdict is only taken
+ * when probe_repeats() finds few repeated strings in the same runs */
+int classify_block(const BYTE* buf, unsigned size) {
+	unsigned counts[256] = { 0 };
+	unsigned i, j, runs, step, n = 0;
+	double sum = 0;
+
+	if(size < 4096)
+		return PATH_DEFLATE; /* too little to judge, and cheap anyway */
+	runs = size / 256 < 64 ? size / 256 : 64;
+	step = size / runs;
+	for(i = 0; i < runs; i++)
+		for(j = 0; j < 256; j++)
+			counts[buf[i * step + j]]++;
+	n = runs * 256;
+	for(i = 0; i < 256; i++)
+		sum += (double) counts[i] * counts[i];
+	sum /= (double) n * n;
+
+	/* a uniform sample of n bytes has sum(p^2) near 1/256 + 1/n */
+	if(sum - 1.0 / n > 0.0055243) /* 2^-7.5 */
+		return PATH_DEFLATE;
+	if(probe_repeats(buf, runs, step) >= n / 16)
+		return PATH_DEFLATE;
+	if(sum - 1.0 / n <= 0.0041866) /* 2^-7.9 */
+		return PATH_STORED;
+	return PATH_HUFFMAN;
+}
+
+/* Count the 4 byte strings of the sampled runs of classify_block() that
+ * already appeared earlier in the sample, using a small direct-mapped table
+ * of the last string seen per hash.  Random data repeats a string about
+ * once in 2^32 tries, periodic data nearly every time */
+unsigned probe_repeats(const BYTE* buf, unsigned runs, unsigned step) {
+	unsigned long long seen[1 << PROBE_BITS] = { 0 }; /* string + 1, 0 is empty */
+	unsigned i, j, hits = 0;
+
+	for(i = 0; i < runs; i++) {
+		const BYTE* p = buf + i * step;
+		for(j = 0; j + 4 <= 256; j++) {
+			unsigned long long v = (unsigned long long) get_le32(p + j) + 1;
+			unsigned h = ((unsigned) v * 2654435761u) >> (32 - PROBE_BITS);
+
+			hits += seen[h] == v;
+			seen[h] = v;
+		}
+	}
+	return hits;
+}
+
+/* Print how many blocks were compressed at each level */
+void print_levels(const unsigned long* levels) {
+	int i;
+
+	fprintf(log_fp, "  levels:");
+	for(i = 0; i < 10; i++)
+		if(levels[i])
+			fprintf(log_fp, " %d x %lu", i, levels[i]);
+	fprintf(log_fp, "\n");
+}
+
+/* Worker thread entry point, compresses blocks until the job queue is closed */
 void* compression(void* thread) {
 	worker_t* worker = (worker_t*) thread;
-	
-	def(worker->input_buf, worker->input_size, worker->output_buf, CHUNK_SIZE * 1.2, &worker->output_size);
+	pipeline_t* pl = worker->pipeline;
+	block_t* block;
+	struct timeval start;
+
+	worker_start(worker);
+	if(def_init(&worker->strm, worker, pl->opts, pl->single_stream) != Z_OK) {
+		fprintf(stderr, "Failed to allocate deflate state!\n");
+		exit(1);
+	}
+
+	while((block = next_job(worker))) {
+		block->level = pl->adapt.target ? adapt_level(&pl->adapt) : pl->opts->level;
+		block->strategy = pl->opts->strategy;
+		block->path = pl->opts->detect ? classify_block(block->input_buf, block->input_size) : PATH_DEFLATE;
+		if(block->path == PATH_STORED)
+			block->level = 0;
+		else if(block->path == PATH_HUFFMAN)
+			block->strategy = Z_HUFFMAN_ONLY;
+		gettimeofday(&start, NULL);
+		if(pl->single_stream) {
+			if(def_raw(&worker->strm, block->level, block->strategy, block->input_buf, block->input_size, block->dict_buf, block->dict_size, block->output_buf, pl->out_bound, &block->output_size) != Z_OK)
+				pl->error = 1;
+
+			/* per-block checksums are folded together by the writer */
+			if(pl->opts->format == FORMAT_GZIP)
+				block->check = crc32(0L, block->input_buf, block->input_size);
+			else
+				block->check = adler32(1L, block->input_buf, block->input_size);
+		} else if(def(&worker->strm, block->level, block->strategy, block->input_buf, block->input_size, block->output_buf, pl->out_bound, &block->output_size) != Z_OK) {
+			pl->error = 1;
+		}
+		/* detected blocks say nothing about how fast the adapted level is */
+		if(pl->adapt.target && block->path == PATH_DEFLATE)
+			adapt_report(&pl->adapt, block->level, block->input_size, elapsed_ms(&start));
+		worker->blocks++;
+		reorder_put(&pl->done, block);
+	}
+
+	(void)deflateEnd(&worker->strm);
+	return NULL;
+}
+
+/* Worker thread entry point when decompressing an indexed .zl file */
+void* decompression(void* thread) {
+	worker_t* worker = (worker_t*) thread;
+	pipeline_t* pl = worker->pipeline;
+	block_t* block;
+
+	worker_start(worker);
+	worker->strm.zalloc = count_alloc;
+	worker->strm.zfree  = count_free;
+	worker->strm.opaque = worker;
+	worker->strm.avail_in = 0;
+	worker->strm.next_in = Z_NULL;
+	if((pl->checkpoints ? inflateInit2(&worker->strm, -15) : inflateInit(&worker->strm)) != Z_OK) {
+		fprintf(stderr, "Failed to allocate inflate state!\n");
+		exit(1);
+	}
+
+	while((block = next_job(worker))) {
+		if(pl->checkpoints) {
+			/* the reader sets output_size to the span's length */
+			if(inf_span(&worker->strm, block->input_buf, block->input_size, block->bits, block->dict_buf, block->dict_size,
+			            block->output_buf, block->output_size) != Z_OK)
+				pl->error = 1;
+			if(pl->opts->format == FORMAT_GZIP)
+				block->check = crc32(crc32(0L, Z_NULL, 0), block->output_buf, block->output_size);
+			else
+				block->check = adler32(adler32(0L, Z_NULL, 0), block->output_buf, block->output_size);
+		} else if(inf_block(&worker->strm, block->input_buf, block->input_size, block->output_buf,
+		                    pl->index->entries[block->block_id].uncompressed_size, &block->output_size) != Z_OK) {
+			pl->error = 1;
+		}
+		worker->blocks++;
+		reorder_put(&pl->done, block);
+	}
+
+	(void)inflateEnd(&worker->strm);
+	return NULL;
+}
+
+#ifdef HAVE_IO_URING
+struct uring {
+	int fd;
+	int file_fd;       /* file every read or write of this ring goes to */
+	unsigned entries;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned sq_local_tail; /* sqes filled in but not yet published */
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned pending;  /* sqes queued but not submitted */
+	unsigned inflight; /* submitted but not reaped */
+	char fixed;        /* buffers are registered, use READ_FIXED/WRITE_FIXED */
+};
+
+void uring_exit(struct uring* r);
+
+/* Set up a ring with room for entries requests, returns 0 on success */
+int uring_init(struct uring* r, unsigned entries, int file_fd) {
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->sq_ring = r->cq_ring = r->sqes = MAP_FAILED;
+	r->file_fd = file_fd;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if(r->fd < 0)
+		return -1;
+
+	r->entries = p.sq_entries;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+		uring_exit(r);
+		return -1;
+	}
+
+	r->sq_head  = (unsigned*) ((char*) r->sq_ring + p.sq_off.head);
+	r->sq_tail  = (unsigned*) ((char*) r->sq_ring + p.sq_off.tail);
+	r->sq_mask  = (unsigned*) ((char*) r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*) ((char*) r->sq_ring + p.sq_off.array);
+	r->cq_head  = (unsigned*) ((char*) r->cq_ring + p.cq_off.head);
+	r->cq_tail  = (unsigned*) ((char*) r->cq_ring + p.cq_off.tail);
+	r->cq_mask  = (unsigned*) ((char*) r->cq_ring + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe*) ((char*) r->cq_ring + p.cq_off.cqes);
+	r->sq_local_tail = *r->sq_tail;
+	return 0;
+}
+
+void uring_exit(struct uring* r) {
+	if(r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+	if(r->cq_ring != MAP_FAILED) munmap(r->cq_ring, r->cq_ring_size);
+	if(r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+	if(r->fd >= 0) close(r->fd);
+}
+
+/* Pin the block buffers so the kernel doesn't have to map them on every request */
+void uring_register(struct uring* r, struct iovec* iov, unsigned n) {
+	r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+}
+
+/* Queue a read or write of len bytes at off, data comes back with the completion.
+ * The caller keeps pending + inflight below entries so there is always room */
+void uring_prep(struct uring* r, int write, void* buf, unsigned len, off_t off, int buf_index, void* data) {
+	unsigned idx = r->sq_local_tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if(buf_index >= 0 && r->fixed) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = buf_index;
+	} else {
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->fd = r->file_fd;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = (unsigned long) data;
+	r->sq_array[idx] = idx;
+	r->sq_local_tail++;
+	r->pending++;
+}
+
+/* Submit everything queued and wait for at least wait_nr completions */
+int uring_enter(struct uring* r, unsigned wait_nr) {
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, r->pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while(ret < 0 && errno == EINTR);
+	if(ret < 0)
+		return -1;
+	r->pending -= ret;
+	r->inflight += ret;
+	return 0;
+}
+
+/* Next completion or NULL, release it with uring_seen() */
+struct io_uring_cqe* uring_peek(struct uring* r) {
+	unsigned head = *r->cq_head;
+
+	if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_seen(struct uring* r) {
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+	r->inflight--;
+}
+
+/* Finish a transfer the ring came back short on (or failed) with plain
+ * pread()/pwrite(), returns 0 once all len bytes are done */
+int finish_rw(int fd, int write, BYTE* buf, size_t len, off_t off, int done) {
+	ssize_t n;
+
+	if(done < 0) done = 0;
+	while((size_t) done < len) {
+		n = write ? pwrite(fd, buf + done, len - done, off + done) : pread(fd, buf + done, len - done, off + done);
+		if(n <= 0) return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/* Create the rings asked for with --io=uring.  Only regular files get a
+ * ring (pipes need their requests serialized), mapped inputs need no reads.
+ * Anything that can't be set up stays on stdio */
+void setup_rings(pipeline_t* pl, block_t* blocks, int n_blocks) {
+	struct stat st;
+	struct iovec* iov = malloc(n_blocks * sizeof(struct iovec));
+	int i;
+
+	/* a primed block needs a second read for its dictionary */
+	if(!pl->map && !fstat(fileno(pl->i_fp), &st) && S_ISREG(st.st_mode)) {
+		pl->in_ring = malloc(sizeof(struct uring));
+		if(uring_init(pl->in_ring, n_blocks * 2, fileno(pl->i_fp))) {
+			free(pl->in_ring);
+			pl->in_ring = NULL;
+		} else {
+			for(i = 0; i < n_blocks; i++) {
+				iov[i].iov_base = blocks[i].input_buf;
+				iov[i].iov_len = pl->in_size;
+			}
+			uring_register(pl->in_ring, iov, n_blocks);
+		}
+	}
+
+	if(!fstat(fileno(pl->o_fp), &st) && S_ISREG(st.st_mode)) {
+		pl->out_ring = malloc(sizeof(struct uring));
+		if(uring_init(pl->out_ring, n_blocks, fileno(pl->o_fp))) {
+			free(pl->out_ring);
+			pl->out_ring = NULL;
+		} else {
+			for(i = 0; i < n_blocks; i++) {
+				iov[i].iov_base = blocks[i].output_buf;
+				iov[i].iov_len = pl->out_bound;
+			}
+			uring_register(pl->out_ring, iov, n_blocks);
+		}
+	}
+	free(iov);
+
+	fprintf(log_fp, "io_uring: reads %s, writes %s\n",
+		pl->in_ring ? (pl->in_ring->fixed ? "registered buffers" : "yes") : "stdio",
+		pl->out_ring ? (pl->out_ring->fixed ? "registered buffers" : "yes") : "stdio");
+}
+
+void teardown_rings(pipeline_t* pl) {
+	if(pl->in_ring) {
+		uring_exit(pl->in_ring);
+		free(pl->in_ring);
+	}
+	if(pl->out_ring) {
+		uring_exit(pl->out_ring);
+		free(pl->out_ring);
+	}
+}
+
+/* Reader stage on io_uring.  Reads for every free block are queued ahead
+ * at their file offsets, so the kernel fetches upcoming blocks while the
+ * workers are busy; a block goes to the workers once its read (and its
+ * dictionary read when priming) completes, in whatever order that happens.
+ * The reorder ring puts them back in order for the writer */
+void* reader_uring(pipeline_t* pl) {
+	struct uring* r = pl->in_ring;
+	struct io_uring_cqe* cqe;
+	struct stat st;
+	block_t* block;
+	block_t* eof_block = NULL;
+	int read_id = 0, dict, res;
+	unsigned want;
+	off_t offset = 0, size = 0;
+
+	if(!pl->decompress && !fstat(r->file_fd, &st))
+		size = st.st_size;
+	if((offset = ftello(pl->i_fp)) < 0)
+		offset = 0;
+
+	while(!eof_block || r->inflight) {
+		/* queue reads into every free block, only wait for one when nothing is in flight */
+		while(!eof_block) {
+			block = r->pending || r->inflight ? queue_try_pop(&pl->free_blocks) : queue_pop(&pl->free_blocks, &pl->stats.read_stall_ms);
+			if(!block) break;
+			if(pl->checkpoints)
+				want = next_span(pl, block, &offset);
+			else if(pl->decompress)
+				want = read_id < pl->index->count ? pl->index->entries[read_id].compressed_size : 0;
+			else
+				want = size - offset < pl->opts->block_size ? size - offset : pl->opts->block_size;
+			block->block_id = read_id++;
+			block->input_size = want;
+			if(!want) {
+				eof_block = block;
+				break;
+			}
+			block->file_offset = offset;
+			block->pending = 1;
+			/* O_DIRECT reads the whole sector holding the tail, the buffer is a
+			 * multiple of the alignment so it always fits */
+			if(pl->direct)
+				want = (want + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+			uring_prep(r, 0, block->input_buf, want, offset, block->buf_index, block);
+			if(pl->opts->prime) {
+				/* the low pointer bit tells the dictionary read apart */
+				block->dict_size = offset < DICT_SIZE ? offset : DICT_SIZE;
+				if(block->dict_size) {
+					block->pending++;
+					uring_prep(r, 0, block->dict_buf, block->dict_size, offset - block->dict_size, -1, (char*) block + 1);
+				}
+			}
+			offset += block->input_size;
+		}
+		if(!r->pending && !r->inflight)
+			break;
+
+		if(uring_enter(r, 1)) {
+			fprintf(log_fp, "io_uring read failed!\n");
+			exit(1);
+		}
+		while((cqe = uring_peek(r))) {
+			dict = cqe->user_data & 1;
+			block = (block_t*) (unsigned long) (cqe->user_data & ~1UL);
+			res = cqe->res;
+			uring_seen(r);
+
+			if(dict)
+				res = finish_rw(r->file_fd, 0, block->dict_buf, block->dict_size, block->file_offset - block->dict_size, res);
+			else
+				res = finish_rw(r->file_fd, 0, block->input_buf, block->input_size, block->file_offset, res);
+			if(res)
+				pl->error = 1;
+			if(!--block->pending)
+				submit_job(pl, block);
+		}
+	}
 
-	worker->alive = 2;
+	reorder_put(&pl->done, eof_block);
+	close_jobs(pl);
 	return NULL;
 }
 
-void deflate_file(const char* input_fn, const char* output_fn, int n_workers) {
-	FILE *i_fp, *o_fp;
-	int i;
-	worker_t* workers = calloc(n_workers, sizeof(worker_t));
+/* Hand blocks whose writes completed back to the reader, waiting for at
+ * least one when wait is set */
+void reap_writes(pipeline_t* pl, int wait) {
+	struct uring* r = pl->out_ring;
+	struct io_uring_cqe* cqe;
+	block_t* block;
+	int res;
+
+	if(uring_enter(r, wait && (r->inflight || r->pending) ? 1 : 0)) {
+		fprintf(log_fp, "io_uring write failed!\n");
+		exit(1);
+	}
+	while((cqe = uring_peek(r))) {
+		block = (block_t*) (unsigned long) cqe->user_data;
+		res = cqe->res;
+		uring_seen(r);
+		if(finish_rw(r->file_fd, 1, block->output_buf, block->output_size, block->file_offset, res))
+			pl->error = 1;
+		queue_push(&pl->free_blocks, block, NULL);
+	}
+}
+
+/* Queue the write of a block at *offset on the writer's ring */
+void write_block_uring(pipeline_t* pl, block_t* block, off_t* offset) {
+	struct uring* r = pl->out_ring;
+
+	while(r->pending + r->inflight >= r->entries)
+		reap_writes(pl, 1);
+	block->file_offset = *offset;
+	uring_prep(r, 1, block->output_buf, block->output_size, *offset, block->buf_index, block);
+	(*offset) += block->output_size;
+	reap_writes(pl, 0);
+}
+#endif
+
+/* Reader stage, fills free blocks from the input file and queues them for
+ * the workers.  An empty block is parked in the reorder ring at EOF so the
+ * writer knows when to stop.  When priming, the tail of the previous block
+ * is copied into the new block's dictionary before the read, since the
+ * free block handed back may be the previous block itself.  When
+ * decompressing, each read is the compressed size of the next indexed block.
+ * With a mapped input nothing is copied, blocks (and their dictionaries)
+ * just point into the mapping and the next block is prefetched */
+void* reader(void* arg) {
+	pipeline_t* pl = (pipeline_t*) arg;
+	block_t* block;
+	block_t* prev = NULL;
+	int read_id = 0;
+	unsigned want;
+	off_t offset = 0;
+
+#ifdef HAVE_IO_URING
+	if(pl->in_ring)
+		return reader_uring(pl);
+#endif
+
+	for(;;) {
+		block = queue_pop(&pl->free_blocks, &pl->stats.read_stall_ms);
+		if(pl->map) {
+			want = pl->map_size - offset < pl->opts->block_size ? pl->map_size - offset : pl->opts->block_size;
+			block->input_buf = pl->map + offset;
+			block->input_size = want;
+			if(pl->opts->prime) {
+				block->dict_size = offset < DICT_SIZE ? offset : DICT_SIZE;
+				block->dict_buf = block->input_buf - block->dict_size;
+			}
+			offset += want;
+			if(offset < pl->map_size)
+				advise_readahead(pl->map + offset, pl->map_size - offset < pl->opts->block_size ? pl->map_size - offset : pl->opts->block_size);
+			goto dispatch;
+		}
+
+		if(pl->opts->prime) {
+			block->dict_size = 0;
+			if(prev) {
+				block->dict_size = prev->input_size < DICT_SIZE ? prev->input_size : DICT_SIZE;
+				memcpy(block->dict_buf, prev->input_buf + prev->input_size - block->dict_size, block->dict_size);
+			}
+			prev = block;
+		}
+		if(pl->checkpoints) {
+			/* spans share the byte where one ends and the next starts */
+			want = next_span(pl, block, &offset);
+			if(want && fseeko(pl->i_fp, offset, SEEK_SET))
+				want = 0, pl->error = 1;
+		} else if(pl->decompress) {
+			want = read_id < pl->index->count ? pl->index->entries[read_id].compressed_size : 0;
+		} else {
+			want = pl->opts->block_size;
+		}
+		if(pl->direct)
+			block->input_size = read_direct(fileno(pl->i_fp), block->input_buf, want);
+		else
+			block->input_size = fread(block->input_buf, 1, want, pl->i_fp);
+		if(pl->decompress && block->input_size != want) {
+			pl->error = want != 0; /* truncated */
+			block->input_size = 0;
+		}
+dispatch:
+		block->block_id = read_id++;
+		if(!block->input_size) {
+			reorder_put(&pl->done, block);
+			break;
+		}
+		submit_job(pl, block);
+	}
+
+	close_jobs(pl);
+	return NULL;
+}
+
+/* Writer stage, dumps compressed blocks in order and hands them back to the
+ * reader.  In single stream mode the blocks are raw deflate segments, so the
+ * writer wraps them in one zlib stream or gzip member: a header, the
+ * segments, an empty final block and a trailer whose checksum is combined
+ * from the per-block ones with adler32_combine()/crc32_combine() */
+void* writer(void* arg) {
+	pipeline_t* pl = (pipeline_t*) arg;
+	block_t* block;
+	BYTE trailer[10];
+	char gzip = pl->opts->format == FORMAT_GZIP;
+	uLong check = gzip ? crc32(0L, Z_NULL, 0) : adler32(0L, Z_NULL, 0);
+	uLong total = 0; /* input length mod 2^32 for the gzip trailer */
+#ifdef HAVE_IO_URING
+	off_t offset = 0;
+#endif
+
+	if(pl->single_stream)
+		write_header(pl->o_fp, pl->opts);
+
+#ifdef HAVE_IO_URING
+	/* ring writes go to explicit offsets after whatever stdio wrote */
+	if(pl->out_ring) {
+		fflush(pl->o_fp);
+		offset = ftello(pl->o_fp);
+	}
+#endif
+
+	for(;;) {
+		block = NULL;
+#ifdef HAVE_IO_URING
+		/* the reader may be waiting on blocks the ring still holds, hand
+		 * them back before sleeping on the next one */
+		if(pl->out_ring && !(block = reorder_try_take(&pl->done)))
+			while(pl->out_ring->inflight)
+				reap_writes(pl, 1);
+#endif
+		if(!block)
+			block = reorder_take(&pl->done, &pl->stats.write_stall_ms);
+		if(!block->input_size) break;
+		if(!pl->out_ring)
+			fwrite(block->output_buf, block->output_size, 1, pl->o_fp);
+		if(pl->single_stream) {
+			if(gzip)
+				check = crc32_combine(check, block->check, block->input_size);
+			else
+				check = adler32_combine(check, block->check, block->input_size);
+			total += block->input_size;
+		} else if(pl->checkpoints) {
+			if(gzip)
+				check = crc32_combine(check, block->check, block->output_size);
+			else
+				check = adler32_combine(check, block->check, block->output_size);
+		}
+		if(pl->index && !pl->decompress)
+			index_add(pl->index, block->output_size, block->input_size, block->level);
+		pl->stats.blocks++;
+		pl->stats.levels[block->level]++;
+		pl->stats.paths[(int) block->path]++;
+		pl->stats.bytes_in += block->input_size;
+		pl->stats.bytes_out += block->output_size;
+#ifdef HAVE_IO_URING
+		if(pl->out_ring) {
+			write_block_uring(pl, block, &offset);
+			continue;
+		}
+#endif
+		queue_push(&pl->free_blocks, block, NULL);
+	}
+
+#ifdef HAVE_IO_URING
+	/* wait for the ring to drain before stdio appends the trailer */
+	if(pl->out_ring) {
+		while(pl->out_ring->inflight || pl->out_ring->pending)
+			reap_writes(pl, 1);
+		fseeko(pl->o_fp, offset, SEEK_SET);
+	}
+#endif
+
+	if(pl->single_stream) {
+		/* empty static block with BFINAL set ends the deflate stream */
+		trailer[0] = 0x03;
+		trailer[1] = 0x00;
+		if(gzip) {
+			put_le32(trailer + 2, check);
+			put_le32(trailer + 6, total & 0xffffffffUL);
+			fwrite(trailer, 1, 10, pl->o_fp);
+		} else {
+			put_be32(trailer + 2, check);
+			fwrite(trailer, 1, 6, pl->o_fp);
+		}
+	} else if(pl->index && !pl->decompress) {
+		write_index(pl->o_fp, pl->index);
+	}
+	pl->check = check;
+	return NULL;
+}
+
+#ifdef HAVE_NUMA
+/* Add the CPUs of a sysfs cpulist ("0-3,8-11") that are also in allowed */
+int parse_cpulist(const char* list, const cpu_set_t* allowed, int* cpus, int n) {
+	char* end;
+	long lo, hi;
+
+	while(*list >= '0' && *list <= '9') {
+		lo = hi = strtol(list, &end, 10);
+		if(*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		for(; lo <= hi && lo < CPU_SETSIZE; lo++)
+			if(CPU_ISSET(lo, allowed))
+				cpus[n++] = lo;
+		list = *end == ',' ? end + 1 : end;
+	}
+	return n;
+}
+
+int cmp_int(const void* a, const void* b) {
+	return *(const int*) a - *(const int*) b;
+}
+#endif
+
+/* Pick a CPU for every worker for --numa.  Workers are split into
+ * contiguous runs, one run per NUMA node that has CPUs we may use, so a
+ * worker stealing from the next one over mostly stays on its own node.
+ * Without a sysfs node list all allowed CPUs count as one node.  Returns
+ * the # of nodes used, 0 if the workers can't be pinned */
+int numa_plan(worker_t* workers, int n_workers) {
+#ifdef HAVE_NUMA
+	cpu_set_t allowed;
+	DIR* dir;
+	struct dirent* ent;
+	FILE* fp;
+	char path[64], list[4096];
+	int *ids = NULL, *cpus, *first;
+	int n_ids = 0, n_cpus = 0, n_nodes = 0, i, k, lo, hi;
+
+	if(sched_getaffinity(0, sizeof(allowed), &allowed))
+		return 0;
+	cpus = malloc(CPU_SETSIZE * sizeof(int));
+	first = malloc((CPU_SETSIZE + 1) * sizeof(int));
+
+	if((dir = opendir("/sys/devices/system/node"))) {
+		while((ent = readdir(dir)))
+			if(!strncmp(ent->d_name, "node", 4) && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+				ids = realloc(ids, (n_ids + 1) * sizeof(int));
+				ids[n_ids++] = atoi(ent->d_name + 4);
+			}
+		closedir(dir);
+	}
+	qsort(ids, n_ids, sizeof(int), cmp_int);
+	for(i = 0; i < n_ids && n_nodes < CPU_SETSIZE; i++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+		if(!(fp = fopen(path, "r")))
+			continue;
+		first[n_nodes] = n_cpus;
+		if(fgets(list, sizeof(list), fp))
+			n_cpus = parse_cpulist(list, &allowed, cpus, n_cpus);
+		fclose(fp);
+		if(n_cpus > first[n_nodes]) /* memory-only nodes have no CPUs */
+			n_nodes++;
+	}
+	if(!n_nodes) {
+		first[0] = 0;
+		for(i = 0; i < CPU_SETSIZE; i++)
+			if(CPU_ISSET(i, &allowed))
+				cpus[n_cpus++] = i;
+		n_nodes = n_cpus > 0;
+	}
+	first[n_nodes] = n_cpus;
+
+	for(k = 0; k < n_nodes; k++) {
+		lo = k * n_workers / n_nodes;
+		hi = (k + 1) * n_workers / n_nodes;
+		for(i = lo; i < hi; i++) {
+			workers[i].node = k;
+			workers[i].cpu = cpus[first[k] + (i - lo) % (first[k + 1] - first[k])];
+		}
+	}
+	free(ids);
+	free(cpus);
+	free(first);
+	return n_nodes < n_workers ? n_nodes : n_workers;
+#else
+	(void) workers;
+	(void) n_workers;
+	return 0;
+#endif
+}
+
+/* Run a reader, n_workers copies of work and a writer over pl until the
+ * input is exhausted, then print the per-run counters.  pl's files, options
+ * and buffer sizes must be set up by the caller */
+void run_pipeline(pipeline_t* pl, void* (*work)(void*), int n_workers) {
+	int i, n_blocks, n_nodes = 0;
+	worker_t* workers;
+	block_t* blocks;
+	pthread_t reader_thread, writer_thread;
+	stats_t* stats = &pl->stats;
+	struct timeval start, run_start;
+	unsigned long allocs = 0;
+	double run_ms;
+
+	/* two blocks per worker so one can be filled while the other is
+	 * compressed, plus one each for the reader and writer to work on */
+	n_blocks = n_workers * 2 + 2;
+	if(posix_memalign((void**) &workers, CACHE_LINE, n_workers * sizeof(worker_t)))
+		exit(1);
+	memset(workers, 0, n_workers * sizeof(worker_t));
+	if(posix_memalign((void**) &blocks, CACHE_LINE, n_blocks * sizeof(block_t)))
+		exit(1);
+	memset(blocks, 0, n_blocks * sizeof(block_t));
+	queue_init(&pl->free_blocks, n_blocks);
+	queue_init(&pl->jobs, n_blocks);
+	sched_init(&pl->sched, n_workers, n_blocks);
+	adapt_init(&pl->adapt, pl->opts, n_workers);
+	reorder_init(&pl->done, n_blocks);
+#ifdef HAVE_DIRECT_IO
+	pl->direct = !pl->map && (fcntl(fileno(pl->i_fp), F_GETFL) & O_DIRECT);
+#else
+	pl->direct = 0;
+#endif
+	for(i = 0; i < n_blocks; i++) {
+		if(!pl->map)
+			blocks[i].input_buf = alloc_buf(pl->in_size, pl->direct);
+		blocks[i].output_buf = malloc(pl->out_bound);
+		if((pl->opts->prime || pl->checkpoints) && !pl->map)
+			blocks[i].dict_buf = alloc_buf(DICT_SIZE, pl->direct);
+		blocks[i].buf_index = i;
+		blocks[i].home = i % n_workers;
+	}
+	memset(stats, 0, sizeof(stats_t));
+	pl->error = 0;
+	pl->in_ring = pl->out_ring = NULL;
+	pl->blocks = blocks;
+	pl->n_blocks = n_blocks;
+	pl->n_workers = n_workers;
+	if(pl->opts->numa && (n_nodes = numa_plan(workers, n_workers)))
+		fprintf(log_fp, "NUMA: %d workers pinned over %d node%s\n", n_workers, n_nodes, n_nodes == 1 ? "" : "s");
+	else if(pl->opts->numa)
+		fprintf(log_fp, "NUMA: can't pin workers here, running unpinned.\n");
+	pl->numa = n_nodes > 0;
+
+	/* start the pool once, workers live for the whole run */
+	gettimeofday(&start, NULL);
+	run_start = start;
+#ifdef HAVE_NUMA
+	if(pl->numa)
+		pthread_barrier_init(&pl->touched, NULL, n_workers + 1);
+#endif
+	for(i = 0; i < n_workers; i++) {
+		workers[i].id = i;
+		workers[i].pipeline = pl;
+		pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+	}
+	stats->thread_mgmt_ms += elapsed_ms(&start);
+	gettimeofday(&start, NULL);
+
+	/* with --numa the blocks stay off the free list until their home
+	 * workers have touched them, the reader would fault them in first */
+#ifdef HAVE_NUMA
+	if(pl->numa)
+		pthread_barrier_wait(&pl->touched);
+#endif
+	for(i = 0; i < n_blocks; i++)
+		queue_push(&pl->free_blocks, &blocks[i], NULL);
+
+	/* registering buffers faults them in too, so rings come after the touch */
+#ifdef HAVE_IO_URING
+	if(pl->opts->io == IO_URING)
+		setup_rings(pl, blocks, n_blocks);
+#else
+	if(pl->opts->io == IO_URING)
+		fprintf(log_fp, "Built without io_uring, using stdio.\n");
+#endif
+	stats->setup_ms = elapsed_ms(&start);
+
+	/* the writer just blocks on the first block, the reader starts work
+	 * straight away and could get the CPU before the timer is read */
+	gettimeofday(&start, NULL);
+	pthread_create(&writer_thread, NULL, writer, pl);
+	pthread_create(&reader_thread, NULL, reader, pl);
+	stats->threads_created = n_workers + 2;
+	stats->thread_mgmt_ms += elapsed_ms(&start);
+
+	/* writer only returns once every block is on disk */
+	pthread_join(writer_thread, NULL);
+	run_ms = elapsed_ms(&run_start);
 
-	i_fp = fopen(input_fn, "r");
-	o_fp = fopen(output_fn, "w");
+	/* shut the pipeline down */
+	gettimeofday(&start, NULL);
+	pthread_join(reader_thread, NULL);
+	for(i = 0; i < n_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+	stats->thread_mgmt_ms += elapsed_ms(&start);
+#ifdef HAVE_NUMA
+	if(pl->numa)
+		pthread_barrier_destroy(&pl->touched);
+#endif
 
-	/* init workers */
+	fprintf(log_fp, "Stats: %lu blocks, %lu threads created (%.1f blocks/thread), %.3f ms in thread create/join\n",
+		stats->blocks, stats->threads_created,
+		stats->threads_created ? (double) stats->blocks / stats->threads_created : 0.0, stats->thread_mgmt_ms);
+	if(pl->numa || pl->in_ring || pl->out_ring)
+		fprintf(log_fp, "  setup: %.1f ms for%s%s\n", stats->setup_ms, pl->numa ? " first touch of buffers on their nodes" : "",
+			pl->in_ring || pl->out_ring ? (pl->numa ? " and io_uring registration" : " io_uring registration") : "");
+	fprintf(log_fp, "  reader: %.1f ms stalled waiting for a free block\n", stats->read_stall_ms);
+	fprintf(log_fp, "  writer: %.1f ms stalled waiting for the next block\n", stats->write_stall_ms);
 	for(i = 0; i < n_workers; i++) {
-		workers[i].input_buf = malloc(CHUNK_SIZE);
-		workers[i].output_buf = malloc(CHUNK_SIZE * 1.2);
+		fprintf(log_fp, "  worker %d: %lu blocks (%lu stolen), %.1f ms idle waiting for work (%.1f%% of %.1f ms)\n", i,
+			workers[i].blocks, workers[i].steals, workers[i].stall_ms, run_ms > 0 ? 100.0 * workers[i].stall_ms / run_ms : 0.0, run_ms);
+		allocs += workers[i].allocs;
+	}
+	fprintf(log_fp, "  %llu -> %llu bytes, %lu zlib allocations (%.1f per GB of input)\n", stats->bytes_in, stats->bytes_out,
+		allocs, stats->bytes_in ? allocs / (stats->bytes_in / 1e9) : 0.0);
+	if(pl->opts->detect && !pl->decompress)
+		fprintf(log_fp, "  %lu blocks deflated, %lu Huffman only, %lu stored as incompressible\n",
+			stats->paths[PATH_DEFLATE], stats->paths[PATH_HUFFMAN], stats->paths[PATH_STORED]);
+	if(pl->adapt.target) {
+		fprintf(log_fp, "  %.1f MB/s for a target of %.1f MB/s\n", run_ms > 0 ? stats->bytes_in / run_ms / 1000.0 : 0.0, pl->opts->target_mbps);
+		print_levels(stats->levels);
 	}
 
-	printf("Starting compression!\n");
-
-	unsigned int read = CHUNK_SIZE;
-	int read_id = 0;
-	int write_id = 0;
-	for(;;) {
-		/* attempt to find idle threads */
-		if(read == CHUNK_SIZE) {
-			for(i = 0; i < n_workers; i++) {
-				if(!workers[i].alive) {
-					/* read input file into worker */
-					read = fread(workers[i].input_buf, 1, CHUNK_SIZE, i_fp);
-					if(!read) break;
-					//printf("Read %u bytes and assigned to thread %u!\n", read, i);
-					workers[i].block_id = read_id++;
-					workers[i].input_size = read;
-					workers[i].alive = 1;
-
-					/* start thread */
-					pthread_create(&workers[i].thread, NULL, compression, &workers[i]);
-				}
-			}
-		} else {
-			/* break if input file is read and all threads are done */
-			for(i = 0; i < n_workers; i++)
-				if(workers[i].alive) goto end_loop;
-			break;
-			end_loop:;
+	/* free blocks and pipeline */
+#ifdef HAVE_IO_URING
+	teardown_rings(pl);
+#endif
+	queue_destroy(&pl->free_blocks);
+	queue_destroy(&pl->jobs);
+	sched_destroy(&pl->sched);
+	pthread_mutex_destroy(&pl->adapt.lock);
+	reorder_destroy(&pl->done);
+	for(i = 0; i < n_blocks; i++) {
+		if(!pl->map) {
+			free(blocks[i].input_buf);
+			free(blocks[i].dict_buf);
 		}
+		free(blocks[i].output_buf);
+	}
+	free(blocks);
+	free(workers);
+}
+
+/* Compress input_fn to output_fn.  Returns Z_OK, Z_ERRNO if a file can't be
+ * opened or Z_BUF_ERROR if a block didn't compress (or an I/O error) */
+int deflate_file(const char* input_fn, const char* output_fn, const options_t* opts) {
+	pipeline_t pl;
+	block_index_t index;
 
-		/* check if any workers have data to write to the file */
-		for(i = 0; i < n_workers; i++) {
-			if(workers[i].alive == 2 && workers[i].block_id == write_id) {
-				/* dump thread data and set it to idle */
-				fwrite(workers[i].output_buf, workers[i].output_size, 1, o_fp);
-				workers[i].alive = 0;
+	pl.i_fp = opts->direct ? open_direct(input_fn, "r", opts->block_size) : open_file(input_fn, "r");
+	pl.o_fp = opts->direct ? open_direct(output_fn, "w", opts->block_size) : open_file(output_fn, "w");
+	if(!pl.i_fp || !pl.o_fp) {
+		fprintf(log_fp, "Can't open %s!\n", pl.i_fp ? output_fn : input_fn);
+		close_file(pl.i_fp);
+		close_file(pl.o_fp);
+		return Z_ERRNO;
+	}
+	pl.opts = opts;
+	pl.in_size = opts->block_size;
+	pl.out_bound = block_bound(opts);
+	pl.single_stream = opts->prime || opts->format == FORMAT_GZIP;
+	pl.decompress = 0;
+	pl.map = NULL;
 
-				/* ensure thread has completed */
-				pthread_join(workers[i].thread, NULL);
-				write_id++;
+	/* map the input so workers compress straight out of the page cache,
+	 * falls back to reading when the file can't be mapped (or is empty) */
+	if(opts->mmap_input) {
+		struct stat st;
+		if(!fstat(fileno(pl.i_fp), &st) && st.st_size > 0) {
+			pl.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(pl.i_fp), 0);
+			if(pl.map == MAP_FAILED) {
+				pl.map = NULL;
+				fprintf(log_fp, "Can't map input, reading it instead.\n");
+			} else {
+				pl.map_size = st.st_size;
+				(void)madvise(pl.map, pl.map_size, MADV_SEQUENTIAL);
 			}
 		}
-				
 	}
 
-	printf("Compression Finished! Cleaning up.\n");	
+	/* independent blocks get an index so they can be inflated in parallel */
+	memset(&index, 0, sizeof(index));
+	pl.index = pl.single_stream ? NULL : &index;
+	pl.checkpoints = NULL;
 
-	fclose(i_fp);
-	fclose(o_fp);
+	fprintf(log_fp, "Starting compression with %d threads, level %d and %u byte blocks%s%s%s!\n", opts->n_workers, opts->level, opts->block_size,
+		opts->format == FORMAT_GZIP ? " to a gzip member" : "",
+		pl.map ? " from a mapped input" : "",
+		opts->prime ? ", priming each block with the previous 32K" : "");
 
-	/* free workers */
-	for(i = 0; i < n_workers; i++) {
-		free(workers[i].input_buf);
-		free(workers[i].output_buf);
+	run_pipeline(&pl, compression, opts->n_workers);
+
+	if(!pl.error)
+		fprintf(log_fp, "Compression Finished! Cleaning up.\n");
+
+	if(pl.map)
+		munmap(pl.map, pl.map_size);
+	close_file(pl.i_fp);
+	close_file(pl.o_fp);
+	free(index.entries);
+	return pl.error ? Z_BUF_ERROR : Z_OK;
+}
+
+/* Decompress a .zl file with independent blocks, spreading the blocks
+ * listed in index over n_workers threads and writing them back in order.
+ * Returns Z_OK, Z_DATA_ERROR if a block is corrupt or Z_ERRNO */
+int inflate_indexed(FILE* source, FILE* dest, block_index_t* index, const options_t* dopts) {
+	pipeline_t pl;
+	options_t opts = *dopts;
+	int n_workers = opts.n_workers;
+	int i;
+
+	/* only the thread count and I/O backend apply to decompression */
+	opts.prime = 0;
+	opts.mmap_input = 0;
+	opts.target_mbps = 0;
+	opts.detect = 0;
+
+	pl.i_fp = source;
+	pl.o_fp = dest;
+	pl.opts = &opts;
+	pl.single_stream = 0;
+	pl.decompress = 1;
+	pl.index = index;
+	pl.checkpoints = NULL;
+	pl.map = NULL;
+	pl.in_size = pl.out_bound = 1;
+	for(i = 0; i < index->count; i++) {
+		if(index->entries[i].compressed_size > pl.in_size)
+			pl.in_size = index->entries[i].compressed_size;
+		if(index->entries[i].uncompressed_size > pl.out_bound)
+			pl.out_bound = index->entries[i].uncompressed_size;
 	}
-	free(workers);
+
+	fprintf(log_fp, "Starting decompression of %d indexed blocks with %d threads!\n", index->count, n_workers);
+	if(index->count && index->entries[0].level >= 0) {
+		unsigned long levels[10] = { 0 };
+		for(i = 0; i < index->count; i++)
+			levels[index->entries[i].level % 10]++;
+		print_levels(levels);
+	}
+	run_pipeline(&pl, decompression, n_workers);
+
+	if(pl.error) return Z_DATA_ERROR;
+	return ferror(dest) ? Z_ERRNO : Z_OK;
 }
 
-int inflate_file(FILE *source, FILE *dest) {
+/* Decompress zlib or gzip streams one after another.  Only the length
+ * bytes after the first skip bytes of uncompressed data are written,
+ * length < 0 writes everything after skip.  Stops once the range is done */
+int inflate_file(FILE *source, FILE *dest, off_t skip, off_t length) {
 	int ret;
 	unsigned have;
 	z_stream strm;
@@ -174,7 +2138,7 @@ int inflate_file(FILE *source, FILE *dest) {
 	strm.opaque = Z_NULL;
 	strm.avail_in = 0;
 	strm.next_in = Z_NULL;
-	ret = inflateInit(&strm);
+	ret = inflateInit2(&strm, 15 + 32); /* detect zlib or gzip */
 	if (ret != Z_OK)
 		return ret;
 
@@ -206,21 +2170,39 @@ int inflate_file(FILE *source, FILE *dest) {
 			return ret;
 			}
 			have = CHUNK - strm.avail_out;
-			if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
+			if (put_range(dest, out, have, &skip, &length)) {
 				(void)inflateEnd(&strm);
 				return Z_ERRNO;
 			}
+			if (!length) {
+				(void)inflateEnd(&strm);
+				return Z_OK;
+			}
 
 			if(ret == Z_STREAM_END) {
 				int left = strm.avail_in;
 				unsigned char* in_p = strm.next_in;
+
+				/* top up so a block index after the last stream can be spotted */
+				if(left < 4) {
+					memmove(in, in_p, left);
+					in_p = in;
+					left += fread(in + left, 1, CHUNK, source);
+				}
+				if(left >= 4 && !memcmp(in_p, INDEX_MAGIC, 4)) {
+					(void)inflateEnd(&strm);
+					return Z_OK;
+				}
+				if(!left)
+					break; /* end of file right after the stream */
+
 				(void)inflateEnd(&strm);
 				strm.zalloc = Z_NULL;
 				strm.zfree = Z_NULL;
 				strm.opaque = Z_NULL;
 				strm.avail_in = left;
 				strm.next_in = in_p;
-				ret = inflateInit(&strm);
+				ret = inflateInit2(&strm, 15 + 32);
 			}
 		} while (strm.avail_out == 0 || strm.avail_in != 0);
 	/* done when inflate() says it's done */
@@ -231,35 +2213,937 @@ int inflate_file(FILE *source, FILE *dest) {
 	return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
 }
 
+/* Write the part of buf that falls in the range still to be extracted,
+ * moving skip and length past buf (length < 0 means no end).
+ * Returns 0 on success */
+int put_range(FILE* fp, const BYTE* buf, unsigned size, off_t* skip, off_t* length) {
+	if(*skip >= size) {
+		(*skip) -= size;
+		return 0;
+	}
+	buf += *skip;
+	size -= *skip;
+	(*skip) = 0;
+	if(*length >= 0) {
+		if(size > *length)
+			size = *length;
+		(*length) -= size;
+	}
+	return fwrite(buf, 1, size, fp) != size || ferror(fp);
+}
+
+/* Extract length bytes at offset of the uncompressed data from a .zl file
+ * with a block index.  Seeks straight to the block holding offset and
+ * inflates only the blocks the range covers.  Returns Z_OK, Z_DATA_ERROR
+ * if a block is corrupt, or Z_ERRNO */
+int extract_indexed(FILE* source, FILE* dest, const block_index_t* index, off_t offset, off_t length) {
+	z_stream strm;
+	BYTE* in = NULL;
+	BYTE* out = NULL;
+	off_t in_pos = 0, out_pos = 0;
+	unsigned in_max = 0, out_max = 0, have;
+	int i, first, ret = Z_OK;
+
+	/* find the block holding offset */
+	for(i = 0; i < index->count && out_pos + index->entries[i].uncompressed_size <= offset; i++) {
+		in_pos += index->entries[i].compressed_size;
+		out_pos += index->entries[i].uncompressed_size;
+	}
+	first = i;
+	for(; i < index->count; i++) {
+		if(index->entries[i].compressed_size > in_max)
+			in_max = index->entries[i].compressed_size;
+		if(index->entries[i].uncompressed_size > out_max)
+			out_max = index->entries[i].uncompressed_size;
+	}
+
+	fprintf(log_fp, "Extracting %lld bytes at %lld starting at block %d of %d\n", (long long) length, (long long) offset, first, index->count);
+	if(first == index->count || !length)
+		return Z_OK;
+	if(fseeko(source, in_pos, SEEK_SET))
+		return Z_ERRNO;
+
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	if(inflateInit(&strm) != Z_OK)
+		return Z_MEM_ERROR;
+	in = malloc(in_max);
+	out = malloc(out_max);
+
+	offset -= out_pos;
+	for(i = first; i < index->count && length; i++) {
+		if(fread(in, 1, index->entries[i].compressed_size, source) != index->entries[i].compressed_size) {
+			ret = Z_ERRNO;
+			break;
+		}
+		ret = inf_block(&strm, in, index->entries[i].compressed_size, out, index->entries[i].uncompressed_size, &have);
+		if(ret != Z_OK)
+			break;
+		if(put_range(dest, out, have, &offset, &length)) {
+			ret = Z_ERRNO;
+			break;
+		}
+	}
+	if(ret == Z_OK)
+		fprintf(log_fp, "Inflated %d blocks%s\n", i - first, length > 0 ? ", the range runs past the end" : "");
+
+	(void)inflateEnd(&strm);
+	free(in);
+	free(out);
+	return ret;
+}
+
+/* Scan a whole gzip or zlib stream once and write its access points to
+ * dest, zran's build_index() with the points streamed out as they are
+ * found so the memory used doesn't grow with the file.  A point is added at
+ * the start of the data and then at the first block boundary more than span
+ * bytes of output after the last one.  Only the first stream of a
+ * multi-member file is indexed.  Returns Z_OK, Z_DATA_ERROR, Z_ERRNO or
+ * Z_MEM_ERROR */
+int build_checkpoints(FILE* source, gzFile dest, unsigned span, off_t file_size, int* count) {
+	z_stream strm;
+	BYTE in[CHUNK];
+	BYTE rec[ZRI_RECORD_SIZE];
+	BYTE* window = malloc(DICT_SIZE); /* inflate output, used as a ring */
+	BYTE* history = malloc(DICT_SIZE); /* the ring unrolled */
+	off_t total_in = 0, total_out = 0, last = 0;
+	unsigned size, left;
+	int ret;
+
+	(*count) = 0;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	if(!window || !history || inflateInit2(&strm, 15 + 32) != Z_OK) {
+		free(window);
+		free(history);
+		return Z_MEM_ERROR;
+	}
+
+	memcpy(rec, ZRI_MAGIC, 4);
+	rec[4] = ZRI_VERSION;
+	rec[5] = rec[6] = rec[7] = 0;
+	put_le64(rec + 8, span);
+	put_le64(rec + 16, file_size);
+	if(gzwrite(dest, rec, ZRI_HEADER_SIZE) != ZRI_HEADER_SIZE) {
+		ret = Z_ERRNO;
+		goto done;
+	}
+
+	strm.avail_out = 0;
+	do {
+		strm.avail_in = fread(in, 1, CHUNK, source);
+		if(ferror(source)) {
+			ret = Z_ERRNO;
+			goto done;
+		}
+		if(strm.avail_in == 0) {
+			ret = Z_DATA_ERROR; /* truncated */
+			goto done;
+		}
+		strm.next_in = in;
+
+		/* stop at the end of every deflate block to look for a point */
+		do {
+			if(strm.avail_out == 0) {
+				strm.avail_out = DICT_SIZE;
+				strm.next_out = window;
+			}
+			total_in += strm.avail_in;
+			total_out += strm.avail_out;
+			ret = inflate(&strm, Z_BLOCK);
+			total_in -= strm.avail_in;
+			total_out -= strm.avail_out;
+			if(ret == Z_NEED_DICT)
+				ret = Z_DATA_ERROR;
+			if(ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+				goto done;
+			if(ret == Z_STREAM_END)
+				break;
+
+			/* bit 7 of data_type: at a block boundary, bit 6: after the last block */
+			if((strm.data_type & 128) && !(strm.data_type & 64) && (total_out == 0 || total_out - last > span)) {
+				left = strm.avail_out;
+				if(left)
+					memcpy(history, window + DICT_SIZE - left, left);
+				if(left < DICT_SIZE)
+					memcpy(history + left, window, DICT_SIZE - left);
+				size = total_out < DICT_SIZE ? (unsigned) total_out : DICT_SIZE;
+
+				rec[0] = 'P';
+				rec[1] = strm.data_type & 7;
+				rec[2] = rec[3] = 0;
+				put_le32(rec + 4, size);
+				put_le64(rec + 8, total_in);
+				put_le64(rec + 16, total_out);
+				if(gzwrite(dest, rec, ZRI_RECORD_SIZE) != ZRI_RECORD_SIZE ||
+				   (size && gzwrite(dest, history + DICT_SIZE - size, size) != (int) size)) {
+					ret = Z_ERRNO;
+					goto done;
+				}
+				last = total_out;
+				(*count)++;
+			}
+		} while(strm.avail_in != 0);
+	} while(ret != Z_STREAM_END);
+
+	if(strm.avail_in || fread(in, 1, 1, source))
+		fprintf(log_fp, "Only the first stream is indexed, there is more data after it\n");
+
+	/* the end record holds where the stream ends in both files */
+	memset(rec, 0, ZRI_RECORD_SIZE);
+	rec[0] = 'E';
+	put_le64(rec + 8, total_in);
+	put_le64(rec + 16, total_out);
+	ret = gzwrite(dest, rec, ZRI_RECORD_SIZE) == ZRI_RECORD_SIZE ? Z_OK : Z_ERRNO;
+
+done:
+	(void)inflateEnd(&strm);
+	free(window);
+	free(history);
+	return ret;
+}
+
+/* Open the .zri sidecar of the file fn and check that it belongs to a file
+ * of file_size bytes.  Returns 0 on success, -1 if there is no usable
+ * sidecar */
+int open_checkpoints(checkpoints_t* cp, const char* fn, off_t file_size) {
+	BYTE buf[ZRI_HEADER_SIZE];
+	char* index_fn = malloc(strlen(fn) + sizeof(ZRI_EXT));
+
+	strcpy(index_fn, fn);
+	strcat(index_fn, ZRI_EXT);
+	cp->fp = gzopen(index_fn, "rb");
+	free(index_fn);
+	if(!cp->fp)
+		return -1;
+	if(gzread(cp->fp, buf, ZRI_HEADER_SIZE) != ZRI_HEADER_SIZE || memcmp(buf, ZRI_MAGIC, 4) || buf[4] != ZRI_VERSION)
+		goto fail;
+	cp->span = get_le64(buf + 8);
+	cp->file_size = get_le64(buf + 16);
+	cp->end_in = cp->end_out = -1;
+	if(cp->file_size != file_size) {
+		fprintf(log_fp, "%s%s is stale (made for a %lld byte file), ignoring it\n", fn, ZRI_EXT, (long long) cp->file_size);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	gzclose(cp->fp);
+	cp->fp = NULL;
+	return -1;
+}
+
+/* Read the next access point of a sidecar.  Returns 1 for a point, 0 at the
+ * end record (setting end_in and end_out) or -1 if the sidecar is corrupt */
+int read_checkpoint(checkpoints_t* cp, checkpoint_t* point) {
+	BYTE rec[ZRI_RECORD_SIZE];
+
+	if(gzread(cp->fp, rec, ZRI_RECORD_SIZE) != ZRI_RECORD_SIZE)
+		return -1;
+	if(rec[0] == 'E') {
+		cp->end_in = get_le64(rec + 8);
+		cp->end_out = get_le64(rec + 16);
+		return 0;
+	}
+	point->bits = rec[1];
+	point->window_size = get_le32(rec + 4);
+	point->in = get_le64(rec + 8);
+	point->out = get_le64(rec + 16);
+	if(rec[0] != 'P' || point->bits > 7 || point->window_size > DICT_SIZE || point->in < 1 || point->in > cp->file_size)
+		return -1;
+	if(gzread(cp->fp, point->window, point->window_size) != (int) point->window_size)
+		return -1;
+	return 1;
+}
+
+/* Extract length bytes at offset of the uncompressed data with a checkpoint
+ * index, zran's extract(): inflate starts from the last access point at or
+ * before offset instead of the beginning of the file.  Returns Z_OK,
+ * Z_DATA_ERROR, Z_ERRNO or Z_MEM_ERROR */
+int extract_checkpoints(FILE* source, FILE* dest, checkpoints_t* cp, off_t offset, off_t length) {
+	z_stream strm;
+	checkpoint_t* point = malloc(sizeof(checkpoint_t));
+	checkpoint_t* next = malloc(sizeof(checkpoint_t));
+	checkpoint_t* swap;
+	BYTE in[CHUNK];
+	BYTE out[CHUNK];
+	int ret, n = 0;
+
+	/* find the last point at or before offset */
+	while((ret = read_checkpoint(cp, next)) == 1 && next->out <= offset) {
+		swap = point;
+		point = next;
+		next = swap;
+		n++;
+	}
+	if(ret < 0 || !n) {
+		fprintf(log_fp, "Checkpoint index is corrupt!\n");
+		ret = Z_DATA_ERROR;
+		goto done;
+	}
+	fprintf(log_fp, "Extracting %lld bytes at %lld starting at access point %d (%lld)\n", (long long) length, (long long) offset, n - 1, (long long) point->out);
+
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	if(inflateInit2(&strm, -15) != Z_OK) {
+		ret = Z_MEM_ERROR;
+		goto done;
+	}
+	if(fseeko(source, point->in - (point->bits ? 1 : 0), SEEK_SET)) {
+		ret = Z_ERRNO;
+		goto end;
+	}
+	if(point->bits) {
+		if((ret = getc(source)) == EOF) {
+			ret = ferror(source) ? Z_ERRNO : Z_DATA_ERROR;
+			goto end;
+		}
+		(void)inflatePrime(&strm, point->bits, ret >> (8 - point->bits));
+	}
+	if(point->window_size)
+		(void)inflateSetDictionary(&strm, point->window, point->window_size);
+
+	offset -= point->out;
+	ret = Z_OK;
+	while(length && ret != Z_STREAM_END) {
+		if(strm.avail_in == 0) {
+			strm.avail_in = fread(in, 1, CHUNK, source);
+			if(ferror(source)) {
+				ret = Z_ERRNO;
+				break;
+			}
+			if(strm.avail_in == 0) {
+				ret = Z_DATA_ERROR;
+				break;
+			}
+			strm.next_in = in;
+		}
+		strm.avail_out = CHUNK;
+		strm.next_out = out;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if(ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+			if(ret == Z_NEED_DICT)
+				ret = Z_DATA_ERROR;
+			break;
+		}
+		if(put_range(dest, out, CHUNK - strm.avail_out, &offset, &length)) {
+			ret = Z_ERRNO;
+			break;
+		}
+	}
+	if(ret == Z_STREAM_END || ret == Z_OK || ret == Z_BUF_ERROR)
+		ret = Z_OK;
+
+end:
+	(void)inflateEnd(&strm);
+done:
+	free(point);
+	free(next);
+	return ret;
+}
+
+/* Read through a sidecar once for the sizes of its spans (the buffers of the
+ * pipeline must hold the largest) and the end record, then rewind it to the
+ * first point.  Returns 0 on success */
+int scan_checkpoints(checkpoints_t* cp, unsigned* max_in, unsigned* max_out, int* count) {
+	BYTE rec[ZRI_RECORD_SIZE];
+	off_t in = -1, out = 0, last_in = 0, last_out = 0;
+
+	(*max_in) = (*max_out) = 1;
+	(*count) = 0;
+	for(;;) {
+		if(gzread(cp->fp, rec, ZRI_RECORD_SIZE) != ZRI_RECORD_SIZE || (rec[0] != 'P' && rec[0] != 'E'))
+			return -1;
+		if(in >= 0) {
+			/* a span runs to the next point, or the end of the stream */
+			last_in = get_le64(rec + 8) - in;
+			last_out = get_le64(rec + 16) - out;
+			if(last_in < 1 || last_out < 0 || last_in > MAX_SPAN_BUF || last_out > MAX_SPAN_BUF)
+				return -1;
+			if(last_in > *max_in)
+				(*max_in) = last_in;
+			if(last_out > *max_out)
+				(*max_out) = last_out;
+		}
+		if(rec[0] == 'E') {
+			cp->end_in = get_le64(rec + 8);
+			cp->end_out = get_le64(rec + 16);
+			break;
+		}
+		in = get_le64(rec + 8) - (rec[1] ? 1 : 0);
+		out = get_le64(rec + 16);
+		(*count)++;
+		if(get_le32(rec + 4) > DICT_SIZE || gzseek(cp->fp, get_le32(rec + 4), SEEK_CUR) < 0)
+			return -1;
+	}
+	return *count && gzseek(cp->fp, ZRI_HEADER_SIZE, SEEK_SET) == ZRI_HEADER_SIZE ? 0 : -1;
+}
+
+/* Set a block up for the span that starts at pl->point: its window, bits
+ * and length of output, and read the point after it from the sidecar.
+ * Returns the # of compressed bytes to read at *offset, 0 after the last
+ * span.  Only called from the reader */
+unsigned next_span(pipeline_t* pl, block_t* block, off_t* offset) {
+	checkpoint_t* point = pl->point;
+	off_t out = point->out;
+	int ret;
+
+	if(out < 0)
+		return 0;
+	memcpy(block->dict_buf, point->window, point->window_size);
+	block->dict_size = point->window_size;
+	block->bits = point->bits;
+	(*offset) = point->in - (point->bits ? 1 : 0);
+
+	ret = read_checkpoint(pl->checkpoints, point);
+	if(ret < 0) {
+		pl->error = 1;
+		point->out = -1;
+		return 0;
+	}
+	if(ret == 0) {
+		/* the last span runs to the end of the stream */
+		block->output_size = pl->checkpoints->end_out - out;
+		point->out = -1;
+		return pl->checkpoints->end_in - *offset;
+	}
+	block->output_size = point->out - out;
+	return point->in - *offset;
+}
+
+/* Decompress a single gzip or zlib stream written by another tool on
+ * opts->n_workers threads using its .zri sidecar.  Every span between two
+ * access points is a block of the pipeline: the worker primes a raw inflate
+ * stream with the point's bits and window and inflates exactly the span's
+ * length, and the writer combines the spans' check values to verify the
+ * stream's trailer.  Falls back to inflate_file() when the sidecar doesn't
+ * cover the whole file.  Returns the same codes as inflate_file() */
+int inflate_checkpoints(FILE* source, FILE* dest, checkpoints_t* cp, const options_t* dopts) {
+	pipeline_t pl;
+	options_t opts = *dopts;
+	BYTE buf[8];
+	uLong check;
+	int count;
+
+	opts.prime = 0;
+	opts.mmap_input = 0;
+	opts.target_mbps = 0;
+	opts.detect = 0;
+
+	/* gzip or zlib, anything after the stream (another member) needs the serial path */
+	if(fread(buf, 1, 2, source) != 2 || scan_checkpoints(cp, &pl.in_size, &pl.out_bound, &count) ||
+	   cp->end_in != cp->file_size) {
+		fprintf(log_fp, "Checkpoint index doesn't cover the whole file, decompressing serially\n");
+		rewind(source);
+		return inflate_file(source, dest, 0, -1);
+	}
+	opts.format = buf[0] == 0x1f && buf[1] == 0x8b ? FORMAT_GZIP : FORMAT_ZLIB;
+
+	pl.i_fp = source;
+	pl.o_fp = dest;
+	pl.opts = &opts;
+	pl.single_stream = 0;
+	pl.decompress = 1;
+	pl.index = NULL;
+	pl.checkpoints = cp;
+	pl.map = NULL;
+	pl.point = malloc(sizeof(checkpoint_t));
+	if(read_checkpoint(cp, pl.point) != 1) {
+		free(pl.point);
+		return Z_DATA_ERROR;
+	}
+
+	fprintf(log_fp, "Starting decompression of %d checkpointed spans with %d threads!\n", count, opts.n_workers);
+	run_pipeline(&pl, decompression, opts.n_workers);
+	free(pl.point);
+	if(pl.error) return Z_DATA_ERROR;
+
+	/* the trailer holds the crc32 (and length) or adler32 of the whole stream */
+	if(opts.format == FORMAT_GZIP)
+		check = fseeko(source, cp->end_in - 8, SEEK_SET) || fread(buf, 1, 8, source) != 8 ? ~pl.check : get_le32(buf);
+	else
+		check = fseeko(source, cp->end_in - 4, SEEK_SET) || fread(buf, 1, 4, source) != 4 ? ~pl.check :
+		        ((uLong) buf[0] << 24) | ((uLong) buf[1] << 16) | ((uLong) buf[2] << 8) | buf[3];
+	if(check != pl.check) {
+		fprintf(log_fp, "%s check of the output doesn't match the trailer!\n", opts.format == FORMAT_GZIP ? "CRC-32" : "Adler-32");
+		return Z_DATA_ERROR;
+	}
+	return ferror(dest) ? Z_ERRNO : Z_OK;
+}
+
+/* Parse an offset:length range for -x, returns 0 on success */
+int parse_range(const char* str, off_t* offset, off_t* length) {
+	char* end;
+
+	(*offset) = strtoll(str, &end, 10);
+	if(end == str || *end != ':' || *offset < 0)
+		return -1;
+	str = end + 1;
+	(*length) = strtoll(str, &end, 10);
+	if(end == str || *end || *length < 0)
+		return -1;
+	return 0;
+}
+
+/* Open a file, "-" means stdin or stdout depending on mode.  The input size
+ * is never needed up front so the pipeline works the same on a pipe */
+FILE* open_file(const char* fn, const char* mode) {
+	FILE* fp;
+
+	if(strcmp(fn, "-"))
+		return fopen(fn, mode);
+	fp = mode[0] == 'r' ? stdin : stdout;
+	SET_BINARY_MODE(fp);
+	return fp;
+}
+
+/* Close a file from open_file(), stdin/stdout are only flushed */
+void close_file(FILE* fp) {
+	if(!fp) return;
+	if(fp == stdin || fp == stdout)
+		fflush(fp);
+	else
+		fclose(fp);
+}
+
+/* Block buffer, aligned for O_DIRECT when asked */
+void* alloc_buf(size_t size, char aligned) {
+	void* buf;
+
+	if(!aligned)
+		return malloc(size);
+	return posix_memalign(&buf, DIRECT_ALIGN, size) ? NULL : buf;
+}
+
+/* Fill len bytes from an O_DIRECT fd, every read asks for whole aligned
+ * sectors and the file's tail comes back short.  Returns the bytes read */
+unsigned read_direct(int fd, BYTE* buf, unsigned len) {
+	unsigned done = 0;
+	ssize_t n;
+
+	while(done < len) {
+		n = read(fd, buf + done, (len - done + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1));
+		if(n <= 0) break;
+		done += n;
+	}
+	return done < len ? done : len;
+}
+
+#ifdef HAVE_DIRECT_IO
+/* O_DIRECT output behind a FILE*, so the writer's fwrite()s of unaligned
+ * blocks, headers and the index work unchanged.  Data is staged in an
+ * aligned buffer and written a whole chunk at a time, the tail goes out
+ * with O_DIRECT cleared when the file is closed */
+typedef struct {
+	int fd;
+	BYTE* buf;
+	size_t len;
+	size_t cap; /* multiple of DIRECT_ALIGN */
+} direct_sink_t;
+
+ssize_t direct_write(void* cookie, const char* data, size_t size) {
+	direct_sink_t* d = (direct_sink_t*) cookie;
+	size_t done = 0, n;
+
+	while(done < size) {
+		n = d->cap - d->len < size - done ? d->cap - d->len : size - done;
+		memcpy(d->buf + d->len, data + done, n);
+		d->len += n;
+		done += n;
+		if(d->len == d->cap) {
+			if(write(d->fd, d->buf, d->cap) != (ssize_t) d->cap)
+				return -1;
+			d->len = 0;
+		}
+	}
+	return size;
+}
+
+int direct_close(void* cookie) {
+	direct_sink_t* d = (direct_sink_t*) cookie;
+	int ret = 0;
+
+	if(d->len) {
+		fcntl(d->fd, F_SETFL, fcntl(d->fd, F_GETFL) & ~O_DIRECT);
+		ret = write(d->fd, d->buf, d->len) == (ssize_t) d->len ? 0 : -1;
+	}
+	if(close(d->fd))
+		ret = -1;
+	free(d->buf);
+	free(d);
+	return ret;
+}
+#endif
+
+/* Open a file with O_DIRECT for --direct, chunk is the size of each output
+ * write (a multiple of DIRECT_ALIGN).  Falls back to open_file() for "-" and
+ * on file systems that refuse O_DIRECT */
+FILE* open_direct(const char* fn, const char* mode, unsigned chunk) {
+#ifdef HAVE_DIRECT_IO
+	cookie_io_functions_t io = { NULL, direct_write, NULL, direct_close };
+	direct_sink_t* d;
+	FILE* fp;
+	int fd;
+
+	if(!strcmp(fn, "-"))
+		return open_file(fn, mode);
+	if(mode[0] == 'r')
+		fd = open(fn, O_RDONLY | O_DIRECT);
+	else
+		fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+	if(fd < 0) {
+		if(errno != EINVAL)
+			return NULL;
+		fprintf(log_fp, "%s doesn't support O_DIRECT, using the page cache.\n", fn);
+		return open_file(fn, mode);
+	}
+	if(mode[0] == 'r')
+		return fdopen(fd, "r");
+
+	d = malloc(sizeof(direct_sink_t));
+	d->fd = fd;
+	d->len = 0;
+	d->cap = chunk;
+	d->buf = alloc_buf(chunk, 1);
+	fp = fopencookie(d, "w", io);
+	setvbuf(fp, NULL, _IONBF, 0); /* already staged in d->buf */
+	return fp;
+#else
+	(void) chunk;
+	fprintf(log_fp, "O_DIRECT isn't supported here, using the page cache.\n");
+	return open_file(fn, mode);
+#endif
+}
+
+/* Parse a byte count with an optional k/K or m/M suffix, returns 0 on success */
+int parse_size(const char* str, unsigned* size) {
+	char* end;
+	unsigned long val, mult = 1;
+
+	if(*str < '0' || *str > '9') return -1; /* strtoul() takes signs and spaces */
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	if(end == str || errno == ERANGE) return -1;
+	if(*end == 'k' || *end == 'K') {
+		mult = 1024;
+		end++;
+	} else if(*end == 'm' || *end == 'M') {
+		mult = 1024 * 1024;
+		end++;
+	}
+	if(*end) return -1;
+	/* reject what doesn't fit rather than wrap, -b 4097m isn't 1M */
+	if(val > UINT_MAX / mult) return -1;
+
+	(*size) = val * mult;
+	return 0;
+}
+
+/* Map a --strategy name onto a zlib strategy, returns 0 on success */
+int parse_strategy(const char* str, int* strategy) {
+	if(!strcmp(str, "default"))
+		(*strategy) = Z_DEFAULT_STRATEGY;
+	else if(!strcmp(str, "filtered"))
+		(*strategy) = Z_FILTERED;
+	else if(!strcmp(str, "huffman"))
+		(*strategy) = Z_HUFFMAN_ONLY;
+	else if(!strcmp(str, "rle"))
+		(*strategy) = Z_RLE;
+	else if(!strcmp(str, "fixed"))
+		(*strategy) = Z_FIXED;
+	else
+		return -1;
+	return 0;
+}
+
+void usage(void) {
+	printf("Examples:\n./prog [-1..-9] [-b block_size] [-p] [-m] [-z zlib|gzip] -c file_to_compress #_of_threads\n./prog -d file_to_decompress.zl [#_of_threads]\n./prog -x offset:length file.zl > range\n./prog [--span=size] -i file.gz\n");
+	printf("A file name of - reads stdin and writes stdout, e.g. pg_dump | ./prog -c - 16 > dump.zl\n");
+	printf("  -1..-9             compression level, fastest to best (default 9)\n");
+	printf("  --strategy=name    default, filtered, huffman, rle or fixed\n");
+	printf("  --mem-level=1..9   memory for the match finder, higher is faster (default 8)\n");
+	printf("  -b  block size, 64K to 16M (default 128K)\n");
+	printf("  -p  prime each block with the previous 32K and write a single zlib stream\n");
+	printf("  -z  output format, zlib (default, .zl) or gzip (one gzip member, .gz)\n");
+	printf("  -m  map the input file instead of reading it into buffers\n");
+	printf("  --io=stdio|uring   read and write blocks through io_uring (default stdio)\n");
+	printf("  --sched=steal|queue  per-worker queues with work stealing, or one shared queue (default steal)\n");
+	printf("  --numa             pin workers to CPUs and keep their buffers on their NUMA node\n");
+	printf("  --target-throughput=MB/s  adapt each block's level to sustain this rate, -1..-9 is the highest level used\n");
+	printf("  --no-detect        deflate every block, even ones that look incompressible\n");
+	printf("  -i  write a checkpoint index of a gzip or zlib file to file.zri, used by -x\n");
+	printf("  --span=size        uncompressed bytes between checkpoints, at least 32K (default 1M)\n");
+	printf("  --direct           bypass the page cache with O_DIRECT (block size must be a multiple of 4K)\n");
+}
+
 int main(int argc, char** argv) {
-	char output_fn[100];
+	char* output_fn;
+	options_t opts;
+	char* end;
+	int c, mode = 0, status = 0; /* exit status, 1 when the input couldn't be processed */
+	off_t x_offset = 0, x_length = -1;
+	unsigned span = DEFAULT_SPAN;
+	static const struct option long_opts[] = {
+		{ "strategy",  required_argument, NULL, 'S' },
+		{ "mem-level", required_argument, NULL, 'M' },
+		{ "io",        required_argument, NULL, 'I' },
+		{ "direct",    no_argument,       NULL, 'D' },
+		{ "sched",     required_argument, NULL, 'T' },
+		{ "numa",      no_argument,       NULL, 'N' },
+		{ "target-throughput", required_argument, NULL, 'R' },
+		{ "no-detect", no_argument,       NULL, 'E' },
+		{ "span",      required_argument, NULL, 'P' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	log_fp = stdout;
+	opts.n_workers = 0;
+	opts.block_size = DEFAULT_BLOCK_SIZE;
+	opts.prime = 0;
+	opts.format = FORMAT_ZLIB;
+	opts.level = Z_BEST_COMPRESSION;
+	opts.strategy = Z_DEFAULT_STRATEGY;
+	opts.mem_level = 8;
+	opts.mmap_input = 0;
+	opts.io = IO_STDIO;
+	opts.direct = 0;
+	opts.sched = SCHED_STEAL;
+	opts.numa = 0;
+	opts.target_mbps = 0;
+	opts.detect = 1;
+
+	while((c = getopt_long(argc, argv, "cdix:b:pmz:123456789", long_opts, NULL)) != -1) {
+		switch(c) {
+		case '1': case '2': case '3':
+		case '4': case '5': case '6':
+		case '7': case '8': case '9':
+			opts.level = c - '0';
+			break;
+		case 'S':
+			if(parse_strategy(optarg, &opts.strategy)) {
+				printf("Strategy must be default, filtered, huffman, rle or fixed!\n");
+				return 0;
+			}
+			break;
+		case 'M':
+			opts.mem_level = atoi(optarg);
+			if(opts.mem_level < 1 || opts.mem_level > MAX_MEM_LEVEL) {
+				printf("Memory level must be between 1 and 9!\n");
+				return 0;
+			}
+			break;
+		case 'I':
+			if(!strcmp(optarg, "stdio")) {
+				opts.io = IO_STDIO;
+			} else if(!strcmp(optarg, "uring")) {
+				opts.io = IO_URING;
+			} else {
+				printf("I/O backend must be stdio or uring!\n");
+				return 0;
+			}
+			break;
+		case 'D':
+			opts.direct = 1;
+			break;
+		case 'N':
+			opts.numa = 1;
+			break;
+		case 'E':
+			opts.detect = 0;
+			break;
+		case 'R':
+			opts.target_mbps = strtod(optarg, &end);
+			if(end == optarg || *end || opts.target_mbps <= 0) {
+				printf("Target throughput must be a positive MB/s figure!\n");
+				return 0;
+			}
+			break;
+		case 'T':
+			if(!strcmp(optarg, "steal")) {
+				opts.sched = SCHED_STEAL;
+			} else if(!strcmp(optarg, "queue")) {
+				opts.sched = SCHED_QUEUE;
+			} else {
+				printf("Scheduler must be steal or queue!\n");
+				return 0;
+			}
+			break;
+		case 'P':
+			if(parse_size(optarg, &span) || span < DICT_SIZE) {
+				printf("Span must be at least 32K!\n");
+				return 0;
+			}
+			break;
+		case 'c':
+		case 'd':
+		case 'i':
+			mode = c;
+			break;
+		case 'x':
+			mode = c;
+			if(parse_range(optarg, &x_offset, &x_length)) {
+				printf("Range must be offset:length in bytes!\n");
+				return 0;
+			}
+			break;
+		case 'b':
+			if(parse_size(optarg, &opts.block_size) || opts.block_size < MIN_BLOCK_SIZE || opts.block_size > MAX_BLOCK_SIZE) {
+				printf("Block size must be between 64K and 16M!\n");
+				return 0;
+			}
+			break;
+		case 'p':
+			opts.prime = 1;
+			break;
+		case 'm':
+			opts.mmap_input = 1;
+			break;
+		case 'z':
+			if(!strcmp(optarg, "zlib")) {
+				opts.format = FORMAT_ZLIB;
+			} else if(!strcmp(optarg, "gzip")) {
+				opts.format = FORMAT_GZIP;
+			} else {
+				printf("Format must be zlib or gzip!\n");
+				return 0;
+			}
+			break;
+		default:
+			usage();
+			return 0;
+		}
+	}
 
-	if(argc != 3 && argc != 4) {
-		printf("Must have 3 or 4 args! Examples:\n./prog -c file_to_compress #_of_threads\n./prog -d file_to_decompress.zl\n");
+	if(!mode || optind >= argc) {
+		printf("Must give -c, -d, -x or -i and a file!\n");
+		usage();
+		return 0;
+	}
+	if(opts.direct && opts.block_size % DIRECT_ALIGN) {
+		printf("Block size must be a multiple of 4K with --direct!\n");
 		return 0;
 	}
 
-	strcpy(output_fn, argv[2]);
-	if(!strcmp(argv[1], "-c")) {
-		if(argc != 4) {
-			printf("Must supply # of threads as 4th arg!\n");
+	/* "-" streams stdin to stdout, otherwise the output name is the input plus an extension */
+	output_fn = malloc(strlen(argv[optind]) + 5);
+	strcpy(output_fn, argv[optind]);
+	if(!strcmp(argv[optind], "-"))
+		log_fp = stderr;
+	if(mode == 'c') {
+		if(optind + 1 >= argc) {
+			printf("Must supply # of threads after the file name!\n");
 			return 0;
 		}
-		strcat(output_fn, ".zl");
-		deflate_file(argv[2], output_fn, atoi(argv[3]));
-	} else if(!strcmp(argv[1], "-d")) {
-		FILE* fp, *fpo;
-		strcat(output_fn, ".uc");
-		fp = fopen(argv[2], "r");
-		fpo = fopen(output_fn, "w");
-		inflate_file(fp, fpo);
+		opts.n_workers = atoi(argv[optind + 1]);
+		if(opts.n_workers < 1) {
+			printf("# of threads must be at least 1!\n");
+			return 0;
+		}
+		if(log_fp == stdout)
+			strcat(output_fn, opts.format == FORMAT_GZIP ? ".gz" : ".zl");
+		if(deflate_file(argv[optind], output_fn, &opts) != Z_OK) {
+			fprintf(log_fp, "Compression failed!\n");
+			status = 1;
+		}
+	} else if(mode == 'i') {
+		FILE* fp;
+		gzFile idx;
+		struct stat st;
+		int ret, count;
+
+		strcat(output_fn, ZRI_EXT);
+		fp = fopen(argv[optind], "rb");
+		if(!fp || fstat(fileno(fp), &st) || !S_ISREG(st.st_mode)) {
+			printf("Can't index %s, it must be a regular file!\n", argv[optind]);
+			if(fp) fclose(fp);
+			free(output_fn);
+			return 1;
+		}
+		idx = gzopen(output_fn, "wb");
+		if(!idx) {
+			printf("Can't open %s!\n", output_fn);
+			fclose(fp);
+			free(output_fn);
+			return 1;
+		}
+		ret = build_checkpoints(fp, idx, span, st.st_size, &count);
+		if(gzclose(idx) != Z_OK && ret == Z_OK)
+			ret = Z_ERRNO;
+		if(ret == Z_OK) {
+			stat(output_fn, &st);
+			printf("Wrote %d access points to %s (%lld bytes)\n", count, output_fn, (long long) st.st_size);
+		} else {
+			printf("Indexing failed! (%d)\n", ret);
+			remove(output_fn);
+			status = 1;
+		}
 		fclose(fp);
-		fclose(fpo);
 	} else {
-		printf("Second arg must be either -c or -d\n");
-		return 0;
+		FILE* fp, *fpo;
+		block_index_t index;
+		checkpoints_t cp;
+		struct stat st;
+		int ret;
+
+		opts.n_workers = optind + 1 < argc ? atoi(argv[optind + 1]) : 1;
+		if(opts.n_workers < 1) {
+			printf("# of threads must be at least 1!\n");
+			return 0;
+		}
+		if(mode == 'x') {
+			/* extracted ranges go to stdout */
+			log_fp = stderr;
+			strcpy(output_fn, "-");
+		} else if(log_fp == stdout) {
+			strcat(output_fn, ".uc");
+		}
+		fp = open_file(argv[optind], "r");
+		fpo = opts.direct ? open_direct(output_fn, "w", opts.block_size) : open_file(output_fn, "w");
+		if(!fp || !fpo) {
+			fprintf(log_fp, "Can't open %s!\n", fp ? output_fn : argv[optind]);
+			close_file(fp);
+			close_file(fpo);
+			free(output_fn);
+			return 1;
+		}
+
+		/* blocks can only be spread over workers when the file carries an index,
+		 * which needs a seekable input so a pipe always goes through inflate_file().
+		 * Without one a -i sidecar splits the stream into spans for the workers
+		 * (or says where to start a range), otherwise it is inflated serially */
+		if(!read_index(fp, &index)) {
+			if(mode == 'x')
+				ret = extract_indexed(fp, fpo, &index, x_offset, x_length);
+			else
+				ret = inflate_indexed(fp, fpo, &index, &opts);
+			free(index.entries);
+		} else if(strcmp(argv[optind], "-") && !fstat(fileno(fp), &st) && S_ISREG(st.st_mode) &&
+		          !open_checkpoints(&cp, argv[optind], st.st_size)) {
+			if(mode == 'x')
+				ret = extract_checkpoints(fp, fpo, &cp, x_offset, x_length);
+			else
+				ret = inflate_checkpoints(fp, fpo, &cp, &opts);
+			gzclose(cp.fp);
+		} else {
+			ret = inflate_file(fp, fpo, x_offset, x_length);
+		}
+		if(ret != Z_OK) {
+			fprintf(log_fp, "Decompression failed! (%d)\n", ret);
+			status = 1;
+		}
+		close_file(fp);
+		close_file(fpo);
 	}
 
-	return 0;
+	free(output_fn);
+	return status;
 }
-
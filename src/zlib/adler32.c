@@ -59,6 +59,16 @@ local uLong adler32_combine_ OF((uLong adler1, uLong adler2, z_off64_t len2));
 #  define MOD63(a) a %= BASE
 #endif
 
+/* SSSE3 and AVX2 kernels for whole 32-byte blocks */
+#ifdef X86_SIMD
+#  include <immintrin.h>
+#  define SIMD_MIN 64       /* shortest buffer worth the setup */
+Z_TARGET("ssse3") local uLong adler32_ssse3 OF((uLong adler, const Bytef *buf,
+                                               z_size_t len));
+Z_TARGET("avx2") local uLong adler32_avx2 OF((uLong adler, const Bytef *buf,
+                                             z_size_t len));
+#endif
+
 /* ========================================================================= */
 uLong ZEXPORT adler32_z(adler, buf, len)
     uLong adler;
@@ -99,6 +109,23 @@ uLong ZEXPORT adler32_z(adler, buf, len)
         return adler | (sum2 << 16);
     }
 
+#ifdef X86_SIMD
+    /* vector kernels do the 32-byte blocks, the code below the tail */
+    if (len >= SIMD_MIN && (x86_cpu_has("avx2") || x86_cpu_has("ssse3"))) {
+        z_size_t blocks = len & ~(z_size_t)31;
+
+        adler |= sum2 << 16;
+        if (x86_cpu_has("avx2"))
+            adler = adler32_avx2(adler, buf, blocks);
+        else
+            adler = adler32_ssse3(adler, buf, blocks);
+        sum2 = adler >> 16;
+        adler &= 0xffff;
+        buf += blocks;
+        len -= blocks;
+    }
+#endif
+
     /* do length NMAX blocks -- requires just one modulo operation */
     while (len >= NMAX) {
         len -= NMAX;
@@ -130,6 +157,121 @@ uLong ZEXPORT adler32_z(adler, buf, len)
     return adler | (sum2 << 16);
 }
 
+#ifdef X86_SIMD
+/* =========================================================================
+ * Adler-32 of len bytes, a multiple of 32, as in Chromium's adler32_simd.c.
+ * For each 32-byte block, psadbw sums the bytes into s1, and pmaddubsw then
+ * pmaddwd weight them by 32..1 into s2.  The 32 * s1 that every block adds
+ * to s2 is gathered in ps (s1 before each block) and added once at the end.
+ * Both sums are reduced every NMAX bytes at most, like the scalar code.
+ */
+local uLong adler32_ssse3(adler, buf, len)
+    uLong adler;
+    const Bytef *buf;
+    z_size_t len;
+{
+    unsigned long s1 = adler & 0xffff;
+    unsigned long s2 = (adler >> 16) & 0xffff;
+    z_size_t blocks = len / 32;
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                       24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                       8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i v_ps, v_s1, v_s2, bytes1, bytes2;
+    unsigned n;
+
+    while (blocks) {
+        n = NMAX / 32;
+        if (n > blocks)
+            n = (unsigned)blocks;
+        blocks -= n;
+
+        v_ps = _mm_cvtsi32_si128((int)(s1 * n));
+        v_s2 = _mm_cvtsi32_si128((int)s2);
+        v_s1 = zero;
+        do {
+            bytes1 = _mm_loadu_si128((const __m128i *)buf);
+            bytes2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(
+                       _mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(
+                       _mm_maddubs_epi16(bytes2, tap2), ones));
+            buf += 32;
+        } while (--n);
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        /* add up the lanes */
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += (unsigned long)(unsigned)_mm_cvtsi128_si32(v_s1);
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = (unsigned long)(unsigned)_mm_cvtsi128_si32(v_s2);
+        MOD(s1);
+        MOD(s2);
+    }
+    return s1 | (s2 << 16);
+}
+
+/* ========================================================================= */
+local uLong adler32_avx2(adler, buf, len)
+    uLong adler;
+    const Bytef *buf;
+    z_size_t len;
+{
+    unsigned long s1 = adler & 0xffff;
+    unsigned long s2 = (adler >> 16) & 0xffff;
+    z_size_t blocks = len / 32;
+    const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                         24, 23, 22, 21, 20, 19, 18, 17,
+                                         16, 15, 14, 13, 12, 11, 10, 9,
+                                         8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i v_ps, v_s1, v_s2, bytes;
+    __m128i sum;
+    unsigned n;
+
+    while (blocks) {
+        n = NMAX / 32;
+        if (n > blocks)
+            n = (unsigned)blocks;
+        blocks -= n;
+
+        v_ps = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)(s1 * n));
+        v_s2 = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)s2);
+        v_s1 = zero;
+        do {
+            bytes = _mm256_loadu_si256((const __m256i *)buf);
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+            v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(
+                       _mm256_maddubs_epi16(bytes, tap), ones));
+            buf += 32;
+        } while (--n);
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+        /* add up the lanes */
+        sum = _mm_add_epi32(_mm256_castsi256_si128(v_s1),
+                            _mm256_extracti128_si256(v_s1, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        s1 += (unsigned long)(unsigned)_mm_cvtsi128_si32(sum);
+        sum = _mm_add_epi32(_mm256_castsi256_si128(v_s2),
+                            _mm256_extracti128_si256(v_s2, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        s2 = (unsigned long)(unsigned)_mm_cvtsi128_si32(sum);
+        MOD(s1);
+        MOD(s2);
+    }
+    return s1 | (s2 << 16);
+}
+#endif /* X86_SIMD */
+
 /* ========================================================================= */
 uLong ZEXPORT adler32(adler, buf, len)
     uLong adler;
@@ -95,6 +95,29 @@ local unsigned read_buf   OF((z_streamp strm, Bytef *buf, unsigned size));
 local uInt longest_match  OF((deflate_state *s, IPos cur_match));
 #endif
 
+#ifdef X86_SIMD
+#  include <immintrin.h>
+Z_TARGET("sse2") local void slide_table_sse2 OF((Posf *table, unsigned n,
+                                                uInt wsize));
+Z_TARGET("avx2") local void slide_table_avx2 OF((Posf *table, unsigned n,
+                                                uInt wsize));
+#endif
+
+#if defined(X86_SIMD) && defined(__SSE2__) && !defined(FASTEST) && \
+    !defined(ASMV) && !defined(UNALIGNED_OK)
+#  define SIMD_MATCH
+local uInt compare258_sse2 OF((const Bytef *scan, const Bytef *match));
+Z_TARGET("avx2") local uInt compare258_avx2 OF((const Bytef *scan,
+                                               const Bytef *match));
+#endif
+
+#ifdef CRC_HASH
+local uInt crc_hash4 OF((const Bytef *str));
+#  define WIN_PAD 4     /* crc_hash4() may read past the end of the window */
+#else
+#  define WIN_PAD 0
+#endif
+
 #ifdef ZLIB_DEBUG
 local  void check_match OF((deflate_state *s, IPos start, IPos match,
                             int length));
@@ -162,6 +185,23 @@ local const config configuration_table[10] = {
  */
 #define UPDATE_HASH(s,h,c) (h = (((h)<<s->hash_shift) ^ (c)) & s->hash_mask)
 
+/* ===========================================================================
+ * Update ins_h for the string at str, whose previous MIN_MATCH-1 bytes have
+ * already been hashed.  With CRC_HASH on a CPU with SSE4.2 the hash is
+ * instead the crc32 of the four bytes at str, which spreads the strings more
+ * evenly over the chains but means equal hashes no longer imply an equal
+ * third byte (see longest_match).
+ */
+#ifdef CRC_HASH
+#define INSERT_HASH(s, str) \
+   ((s)->crc_hash ? \
+    ((s)->ins_h = crc_hash4((s)->window + (str)) & (s)->hash_mask) : \
+    UPDATE_HASH(s, (s)->ins_h, (s)->window[(str) + (MIN_MATCH-1)]))
+#else
+#define INSERT_HASH(s, str) \
+    UPDATE_HASH(s, (s)->ins_h, (s)->window[(str) + (MIN_MATCH-1)])
+#endif
+
 
 /* ===========================================================================
  * Insert string str in the dictionary and set match_head to the previous head
@@ -175,12 +215,12 @@ local const config configuration_table[10] = {
  */
 #ifdef FASTEST
 #define INSERT_STRING(s, str, match_head) \
-   (UPDATE_HASH(s, s->ins_h, s->window[(str) + (MIN_MATCH-1)]), \
+   (INSERT_HASH(s, str), \
     match_head = s->head[s->ins_h], \
     s->head[s->ins_h] = (Pos)(str))
 #else
 #define INSERT_STRING(s, str, match_head) \
-   (UPDATE_HASH(s, s->ins_h, s->window[(str) + (MIN_MATCH-1)]), \
+   (INSERT_HASH(s, str), \
     match_head = s->prev[(str) & s->w_mask] = s->head[s->ins_h], \
     s->head[s->ins_h] = (Pos)(str))
 #endif
@@ -205,6 +245,24 @@ local void slide_hash(s)
     Posf *p;
     uInt wsize = s->w_size;
 
+#ifdef X86_SIMD
+    /* hash_size and w_size are powers of two of at least 256, so whole
+     * vectors cover both tables */
+    if (x86_cpu_has("avx2")) {
+        slide_table_avx2(s->head, s->hash_size, wsize);
+#ifndef FASTEST
+        slide_table_avx2(s->prev, wsize, wsize);
+#endif
+        return;
+    }
+    if (x86_cpu_has("sse2")) {
+        slide_table_sse2(s->head, s->hash_size, wsize);
+#ifndef FASTEST
+        slide_table_sse2(s->prev, wsize, wsize);
+#endif
+        return;
+    }
+#endif
     n = s->hash_size;
     p = &s->head[n];
     do {
@@ -224,6 +282,37 @@ local void slide_hash(s)
 #endif
 }
 
+#ifdef X86_SIMD
+/* ---------------------------------------------------------------------------
+ * slide_hash() for n entries of table, 8 or 16 at a time: an unsigned
+ * saturating subtract (psubusw) of wsize takes any position below the new
+ * window to NIL, which is what the scalar loop does with its compare.
+ */
+local void slide_table_sse2(table, n, wsize)
+    Posf *table;
+    unsigned n;
+    uInt wsize;
+{
+    __m128i w = _mm_set1_epi16((short)wsize);
+    __m128i *p = (__m128i *)table;
+
+    for (; n; n -= 8, p++)
+        _mm_storeu_si128(p, _mm_subs_epu16(_mm_loadu_si128(p), w));
+}
+
+local void slide_table_avx2(table, n, wsize)
+    Posf *table;
+    unsigned n;
+    uInt wsize;
+{
+    __m256i w = _mm256_set1_epi16((short)wsize);
+    __m256i *p = (__m256i *)table;
+
+    for (; n; n -= 16, p++)
+        _mm256_storeu_si256(p, _mm256_subs_epu16(_mm256_loadu_si256(p), w));
+}
+#endif /* X86_SIMD */
+
 /* ========================================================================= */
 int ZEXPORT deflateInit_(strm, level, version, stream_size)
     z_streamp strm;
@@ -318,11 +407,21 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
     s->hash_mask = s->hash_size - 1;
     s->hash_shift =  ((s->hash_bits+MIN_MATCH-1)/MIN_MATCH);
 
-    s->window = (Bytef *) ZALLOC(strm, s->w_size, 2*sizeof(Byte));
+    s->window = (Bytef *) ZALLOC(strm, s->w_size + WIN_PAD, 2*sizeof(Byte));
     s->prev   = (Posf *)  ZALLOC(strm, s->w_size, sizeof(Pos));
     s->head   = (Posf *)  ZALLOC(strm, s->hash_size, sizeof(Pos));
 
     s->high_water = 0;      /* nothing written to s->window yet */
+#ifdef X86_SIMD
+    s->compare258 = Z_NULL;
+#endif
+#ifdef SIMD_MATCH
+    if (x86_cpu_has("avx2"))
+        s->compare258 = compare258_avx2;
+#endif
+#ifdef CRC_HASH
+    s->crc_hash = x86_cpu_has("sse4.2");
+#endif
 
     s->lit_bufsize = 1 << (memLevel + 6); /* 16K elements by default */
 
@@ -339,6 +438,9 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
     }
     s->d_buf = overlay + s->lit_bufsize/sizeof(ush);
     s->l_buf = s->pending_buf + (1+sizeof(ush))*s->lit_bufsize;
+#if WIN_PAD
+    zmemzero(s->window + 2*s->w_size, 2*WIN_PAD);
+#endif
 
     s->level = level;
     s->strategy = strategy;
@@ -418,7 +520,7 @@ int ZEXPORT deflateSetDictionary (strm, dictionary, dictLength)
         str = s->strstart;
         n = s->lookahead - (MIN_MATCH-1);
         do {
-            UPDATE_HASH(s, s->ins_h, s->window[str + MIN_MATCH-1]);
+            INSERT_HASH(s, str);
 #ifndef FASTEST
             s->prev[str & s->w_mask] = s->head[s->ins_h];
 #endif
@@ -1125,7 +1227,7 @@ int ZEXPORT deflateCopy (dest, source)
     zmemcpy((voidpf)ds, (voidpf)ss, sizeof(deflate_state));
     ds->strm = dest;
 
-    ds->window = (Bytef *) ZALLOC(dest, ds->w_size, 2*sizeof(Byte));
+    ds->window = (Bytef *) ZALLOC(dest, ds->w_size + WIN_PAD, 2*sizeof(Byte));
     ds->prev   = (Posf *)  ZALLOC(dest, ds->w_size, sizeof(Pos));
     ds->head   = (Posf *)  ZALLOC(dest, ds->hash_size, sizeof(Pos));
     overlay = (ushf *) ZALLOC(dest, ds->lit_bufsize, sizeof(ush)+2);
@@ -1137,7 +1239,7 @@ int ZEXPORT deflateCopy (dest, source)
         return Z_MEM_ERROR;
     }
     /* following zmemcpy do not work for 16-bit MSDOS */
-    zmemcpy(ds->window, ss->window, ds->w_size * 2 * sizeof(Byte));
+    zmemcpy(ds->window, ss->window, (ds->w_size + WIN_PAD) * 2 * sizeof(Byte));
     zmemcpy((voidpf)ds->prev, (voidpf)ss->prev, ds->w_size * sizeof(Pos));
     zmemcpy((voidpf)ds->head, (voidpf)ss->head, ds->hash_size * sizeof(Pos));
     zmemcpy(ds->pending_buf, ss->pending_buf, (uInt)ds->pending_buf_size);
@@ -1259,7 +1361,9 @@ local uInt longest_match(s, cur_match)
     register ush scan_start = *(ushf*)scan;
     register ush scan_end   = *(ushf*)(scan+best_len-1);
 #else
+#ifndef SIMD_MATCH
     register Bytef *strend = s->window + s->strstart + MAX_MATCH;
+#endif
     register Byte scan_end1  = scan[best_len-1];
     register Byte scan_end   = scan[best_len];
 #endif
@@ -1298,6 +1402,9 @@ local uInt longest_match(s, cur_match)
          */
         if (*(ushf*)(match+best_len-1) != scan_end ||
             *(ushf*)match != scan_start) continue;
+#ifdef CRC_HASH
+        if (s->crc_hash && match[2] != scan[2]) continue;
+#endif
 
         /* It is not necessary to compare scan[2] and match[2] since they are
          * always equal when the other bytes match, given that the hash keys
@@ -1331,16 +1438,28 @@ local uInt longest_match(s, cur_match)
             match[best_len-1] != scan_end1 ||
             *match            != *scan     ||
             *++match          != scan[1])      continue;
+#ifdef CRC_HASH
+        if (s->crc_hash && match[1] != scan[2]) continue;
+#endif
 
         /* The check at best_len-1 can be removed because it will be made
          * again later. (This heuristic is not always a win.)
          * It is not necessary to compare scan[2] and match[2] since they
          * are always equal when the other bytes match, given that
-         * the hash keys are equal and that HASH_BITS >= 8.
+         * the hash keys are equal and that HASH_BITS >= 8.  The crc hash
+         * gives no such guarantee, so it was checked just above.
          */
         scan += 2, match++;
         Assert(*scan == *match, "match[2]?");
 
+#ifdef SIMD_MATCH
+        /* 16 or 32 bytes per step instead of the byte loop */
+        scan -= 2;
+        if (s->compare258 != Z_NULL)
+            len = (int)(*s->compare258)(scan, match - 2);
+        else
+            len = (int)compare258_sse2(scan, match - 2);
+#else
         /* We check for insufficient lookahead only every 8th comparison;
          * the 256th check will be made at strstart+258.
          */
@@ -1355,6 +1474,7 @@ local uInt longest_match(s, cur_match)
 
         len = MAX_MATCH - (int)(strend - scan);
         scan = strend - MAX_MATCH;
+#endif /* SIMD_MATCH */
 
 #endif /* UNALIGNED_OK */
 
@@ -1377,6 +1497,76 @@ local uInt longest_match(s, cur_match)
 }
 #endif /* ASMV */
 
+#ifdef SIMD_MATCH
+/* ---------------------------------------------------------------------------
+ * Return the length of the common prefix of scan and match, up to MAX_MATCH.
+ * Like the byte loop of longest_match(), the first three bytes are taken as
+ * equal and no byte past scan[MAX_MATCH-1] or match[MAX_MATCH-1] is read: the
+ * last step loads the final 16 or 32 bytes again, overlapping the one before.
+ */
+local uInt compare258_sse2(scan, match)
+    const Bytef *scan;
+    const Bytef *match;
+{
+    uInt len = 0;
+    unsigned mask;
+
+    mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+               _mm_loadu_si128((const __m128i *)scan),
+               _mm_loadu_si128((const __m128i *)match))) | 7;
+    for (;;) {
+        mask ^= 0xffff;
+        if (mask != 0) return len + (uInt)__builtin_ctz(mask);
+        if (len == MAX_MATCH - 16) return MAX_MATCH;
+        len += 16;
+        if (len > MAX_MATCH - 16) len = MAX_MATCH - 16;
+        mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                   _mm_loadu_si128((const __m128i *)(scan + len)),
+                   _mm_loadu_si128((const __m128i *)(match + len))));
+    }
+}
+
+local uInt compare258_avx2(scan, match)
+    const Bytef *scan;
+    const Bytef *match;
+{
+    uInt len = 0;
+    unsigned mask;
+
+    mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+               _mm256_loadu_si256((const __m256i *)scan),
+               _mm256_loadu_si256((const __m256i *)match))) | 7;
+    for (;;) {
+        mask ^= 0xffffffff;
+        if (mask != 0) return len + (uInt)__builtin_ctz(mask);
+        if (len == MAX_MATCH - 32) return MAX_MATCH;
+        len += 32;
+        if (len > MAX_MATCH - 32) len = MAX_MATCH - 32;
+        mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                   _mm256_loadu_si256((const __m256i *)(scan + len)),
+                   _mm256_loadu_si256((const __m256i *)(match + len))));
+    }
+}
+#endif /* SIMD_MATCH */
+
+#ifdef CRC_HASH
+/* ---------------------------------------------------------------------------
+ * Hash the four bytes at str with the SSE4.2 crc32 instruction.  This is
+ * written as asm rather than with _mm_crc32_u32() so that it can be inlined
+ * into INSERT_HASH without building the rest of deflate for SSE4.2; it is
+ * only called when deflateInit2() found the instruction on this CPU.
+ */
+local uInt crc_hash4(str)
+    const Bytef *str;
+{
+    unsigned val, crc = 0;
+
+    zmemcpy(&val, str, sizeof(val));
+    __asm__("crc32l %1, %0" : "+r" (crc) : "rm" (val));
+    return crc;
+}
+#endif /* CRC_HASH */
+
 #else /* FASTEST */
 
 /* ---------------------------------------------------------------------------
@@ -1543,7 +1733,7 @@ local void fill_window(s)
             Call UPDATE_HASH() MIN_MATCH-3 more times
 #endif
             while (s->insert) {
-                UPDATE_HASH(s, s->ins_h, s->window[str + MIN_MATCH-1]);
+                INSERT_HASH(s, str);
 #ifndef FASTEST
                 s->prev[str & s->w_mask] = s->head[s->ins_h];
 #endif
@@ -273,6 +273,20 @@ typedef struct internal_state {
      * updated to the new high water mark.
      */
 
+#ifdef X86_SIMD
+    uInt (*compare258) OF((const Bytef *scan, const Bytef *match));
+    /* SIMD length of the match at scan, picked for this CPU by
+     * deflateInit2(), or Z_NULL to compare bytes one at a time.
+     */
+#endif
+
+#ifdef CRC_HASH
+    int crc_hash;
+    /* nonzero if ins_h is the crc32 of the four bytes at the string rather
+     * than the rolling hash of three, see INSERT_HASH in deflate.c
+     */
+#endif
+
 } FAR deflate_state;
 
 /* Output a byte on the stream.
@@ -0,0 +1,78 @@
+/* checkbench.c -- throughput of adler32() and crc32()
+ * For conditions of distribution and use, see copyright notice in zlib.h
+ *
+ * Times each check over buffers of a few sizes and prints GB/s.  Build it
+ * against a -DNO_SIMD libz.a as well to see what the x86 kernels buy:
+ *   make bench
+ *   ./checkbench [total_megabytes]
+ */
+
+#include "zlib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define MAXLEN (1L << 20)
+
+static double seconds OF((void));
+static void bench OF((const char *name, int crc, const Bytef *buf,
+                      unsigned len, unsigned long total));
+
+static double seconds()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* run the check over total bytes, len at a time, best of three */
+static void bench(name, crc, buf, len, total)
+    const char *name;
+    int crc;
+    const Bytef *buf;
+    unsigned len;
+    unsigned long total;
+{
+    unsigned long n, i, check = 0;
+    double start, best = 0;
+    int round;
+
+    n = total / len;
+    for (round = 0; round < 3; round++) {
+        start = seconds();
+        for (i = 0; i < n; i++)
+            check = crc ? crc32(check, buf, len) : adler32(check, buf, len);
+        start = seconds() - start;
+        if (round == 0 || start < best)
+            best = start;
+    }
+    printf("%-8s %8u bytes  %6.2f GB/s  (%08lx)\n", name, len,
+           best > 0 ? (double)n * len / best / 1e9 : 0.0, check);
+}
+
+int main(argc, argv)
+    int argc;
+    char *argv[];
+{
+    static const unsigned lens[] = {64, 1024, 16384, 131072, MAXLEN};
+    unsigned long total = (argc > 1 ? atol(argv[1]) : 256) << 20;
+    Bytef *buf;
+    unsigned i;
+
+    buf = (Bytef *)malloc(MAXLEN);
+    if (buf == NULL || total == 0) {
+        fprintf(stderr, "usage: checkbench [total_megabytes]\n");
+        return 1;
+    }
+    srand(1);
+    for (i = 0; i < MAXLEN; i++)
+        buf[i] = (Bytef)rand();
+
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+        bench("adler32", 0, buf, lens[i], total);
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+        bench("crc32", 1, buf, lens[i], total);
+    free(buf);
+    return 0;
+}
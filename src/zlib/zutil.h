@@ -51,6 +51,25 @@ extern z_const char * const z_errmsg[10]; /* indexed by 2-zlib_error */
 
 #define ERR_MSG(err) z_errmsg[Z_NEED_DICT-(err)]
 
+/* SIMD kernels for x86.  They are compiled with target attributes rather
+   than -m flags and picked at run time from the CPU's feature bits, so the
+   library still runs on any x86 CPU.  Compile with -DNO_SIMD to build only
+   the portable code */
+#if !defined(NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#  define X86_SIMD
+#  define Z_TARGET(isa) __attribute__((target(isa)))
+#  define x86_cpu_has(feature) __builtin_cpu_supports(feature)
+#endif
+
+/* Compile with -DCRC_HASH to have deflate hash four bytes at a time with the
+   SSE4.2 crc32 instruction, when the CPU has it, instead of rolling a hash
+   over three.  The output is still valid deflate but is not byte-identical
+   to that of the default build */
+#if defined(CRC_HASH) && (!defined(X86_SIMD) || defined(FASTEST))
+#  undef CRC_HASH
+#endif
+
 #define ERR_RETURN(strm,err) \
   return (strm->msg = ERR_MSG(err), (err))
 /* To be used only when the state is known to be valid */